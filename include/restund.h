@@ -69,11 +69,22 @@ typedef bool(restund_stun_raw_h)(int proto,
 				 const struct sa *src, const struct sa *dst,
 				 struct mbuf *mb);
 
+/* packet class, from the first byte of a datagram or frame */
+enum restund_pkt {
+	RESTUND_PKT_STUN = 0,  /* 0x00 - 0x3f */
+	RESTUND_PKT_CHAN,      /* 0x40 - 0x7f, ChannelData */
+	RESTUND_PKT_OTHER,
+	RESTUND_PKT_MAX
+};
+
+/* called on the event loop that received the packet, i.e. on any worker */
 struct restund_stun {
 	struct le le;
 	restund_stun_msg_h *reqh;
 	restund_stun_msg_h *indh;
-	restund_stun_raw_h *rawh;
+	restund_stun_raw_h *rawh;   /* STUN class, failed to decode */
+	restund_stun_raw_h *chanh;  /* ChannelData class, not decoded */
+	restund_stun_msg_h *keyh;   /* sets ctx->key of a known client */
 };
 
 void restund_stun_register_handler(struct restund_stun *stun);
@@ -89,11 +100,34 @@ struct restund_trafstat {
 };
 
 
+struct restund_traffic {
+	char username[256];
+	struct sa cli;
+	struct sa relay;
+	struct sa peer;
+	time_t start;
+	time_t end;
+	struct restund_trafstat ts;
+};
+
+
+/* relay rate limits, 0 is unlimited */
+struct restund_limits {
+	uint32_t bps;
+	uint32_t pps;
+};
+
+
 typedef int(restund_db_account_h)(const char *username, const char *ha1,
 				  void *arg);
 typedef int(restund_db_account_all_h)(const char *realm,
 				      restund_db_account_h *acch, void *arg);
 typedef int(restund_db_account_cnt_h)(const char *realm, uint32_t *n);
+/* changes after *version, ha1 is NULL for a deleted account; *version is
+ * updated to the last change. With no handler only the version is read */
+typedef int(restund_db_account_delta_h)(const char *realm, uint64_t *version,
+					restund_db_account_h *acch,
+					void *arg);
 typedef int(restund_db_traffic_log_h)(const char *username,
 				      const struct sa *cli,
 				      const struct sa *relay,
@@ -101,12 +135,26 @@ typedef int(restund_db_traffic_log_h)(const char *username,
 				      const char *realm,
 				      time_t start, time_t end,
 				      const struct restund_trafstat *ts);
+/* direct lookup, called within restund_rcu_read_lock() */
+typedef int(restund_db_ha1_h)(const char *username, uint8_t *ha1);
+/* traffic records are written all or none */
+typedef int(restund_db_traffic_batch_h)(const char *realm,
+					const struct restund_traffic *trv,
+					size_t trc);
+typedef int(restund_db_limit_h)(const char *username,
+				const struct restund_limits *lim, void *arg);
+typedef int(restund_db_limit_all_h)(const char *realm,
+				    restund_db_limit_h *limh, void *arg);
 
 struct restund_db {
 	struct le le;
 	restund_db_account_all_h *allh;
 	restund_db_account_cnt_h *cnth;
 	restund_db_traffic_log_h *tlogh;
+	restund_db_traffic_batch_h *tlogbh;
+	restund_db_limit_all_h *limh;
+	restund_db_account_delta_h *deltah;
+	restund_db_ha1_h *ha1h;
 };
 
 int  restund_log_traffic(const char *username, const struct sa *cli,
@@ -114,10 +162,59 @@ int  restund_log_traffic(const char *username, const struct sa *cli,
 			 time_t start, time_t end,
 			 const struct restund_trafstat *ts);
 int  restund_get_ha1(const char *username, uint8_t *ha1);
+int  restund_get_limits(const char *username, struct restund_limits *lim);
 const char *restund_realm(void);
 void restund_db_set_handler(struct restund_db *db);
 
 
+/* rcu */
+
+void restund_rcu_read_lock(void);
+void restund_rcu_read_unlock(void);
+void restund_rcu_synchronize(void);
+
+
+/* worker */
+
+typedef void(restund_worker_h)(void *arg);
+
+uint32_t restund_worker_count(void);
+uint32_t restund_worker_index(void);
+int  restund_worker_call(uint32_t idx, restund_worker_h *h, void *arg);
+
+
+/* udp batch */
+
+struct restund_batchstat {
+	uint64_t rxc;
+	uint64_t rx_pktc;
+	uint64_t txc;
+	uint64_t tx_pktc;
+	uint64_t tx_errc;
+	uint32_t rx_max;
+	uint32_t tx_max;
+};
+
+struct restund_udp_batch;
+
+uint32_t restund_udp_batch_size(void);
+int  restund_udp_batch_alloc(struct restund_udp_batch **ubp,
+			     struct udp_sock *us, const struct sa *laddr,
+			     udp_recv_h *rh, void *arg,
+			     struct restund_batchstat *stat);
+int  restund_udp_batch_send(struct udp_sock *us, const struct sa *dst,
+			    struct mbuf *mb);
+
+
+/* tcp gather send */
+
+struct iovec;
+
+bool restund_tcp_gather(const struct tcp_conn *tc);
+int  restund_tcp_sendv(struct tcp_conn *tc, const struct iovec *iov,
+		       int iovc);
+
+
 /* div */
 
 struct conf *restund_conf(void);
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <re.h>
 /*#include <re_hmac.h>*/
 #include <restund.h>
@@ -19,6 +20,31 @@ enum {
 	NONCE_EXPIRY   = 3600,
 	NONCE_MAX_SIZE = 48,
 	NONCE_MIN_SIZE = 33,
+	HA1_CACHE_SIZE = 1024,
+};
+
+
+/*
+ * Shared-secret HA1 values are cached per event loop in a bounded LRU,
+ * keyed by username. An entry expires at the timestamp embedded in the
+ * username and is dropped when the secrets change on reload.
+ */
+struct ha1ent {
+	struct le he;
+	struct le le;
+	char *username;
+	uint8_t ha1[MD5_SIZE];
+	time_t expires;
+	uint32_t gen;
+};
+
+struct ha1cache {
+	struct hash *ht;
+	struct list lru;
+	uint32_t count;
+	uint64_t hitc;
+	uint64_t missc;
+	uint64_t evictc;
 };
 
 
@@ -29,7 +55,96 @@ static struct {
 	size_t sharedsecret_length;
 	char sharedsecret2[256];
 	size_t sharedsecret2_length;
-} auth;
+	pthread_mutex_t mutex;
+	struct ha1cache *cachev;
+	uint32_t cachec;
+	uint32_t cache_size;
+	uint32_t gen;
+} auth = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static void ha1ent_destructor(void *arg)
+{
+	struct ha1ent *e = arg;
+
+	hash_unlink(&e->he);
+	list_unlink(&e->le);
+	mem_deref(e->username);
+}
+
+
+static bool ha1ent_cmp_handler(struct le *le, void *arg)
+{
+	const struct ha1ent *e = le->data;
+
+	return !strcmp(e->username, arg);
+}
+
+
+static struct ha1cache *ha1cache(void)
+{
+	const uint32_t idx = restund_worker_index();
+
+	return idx < auth.cachec ? &auth.cachev[idx] : NULL;
+}
+
+
+static struct ha1ent *ha1cache_find(struct ha1cache *c, const char *username)
+{
+	return list_ledata(hash_lookup(c->ht, hash_joaat_str(username),
+				       ha1ent_cmp_handler, (void *)username));
+}
+
+
+static void ha1ent_remove(struct ha1cache *c, struct ha1ent *e)
+{
+	--c->count;
+	mem_deref(e);
+}
+
+
+static void ha1cache_add(struct ha1cache *c, const char *username,
+			 const uint8_t *ha1, time_t expires, uint32_t gen)
+{
+	struct ha1ent *e = ha1cache_find(c, username);
+
+	if (!e) {
+		if (c->count >= auth.cache_size) {
+			ha1ent_remove(c, list_ledata(c->lru.head));
+			++c->evictc;
+		}
+
+		e = mem_zalloc(sizeof(*e), ha1ent_destructor);
+		if (!e)
+			return;
+
+		if (str_dup(&e->username, username)) {
+			mem_deref(e);
+			return;
+		}
+
+		hash_append(c->ht, hash_joaat_str(username), &e->he, e);
+		++c->count;
+	}
+	else {
+		list_unlink(&e->le);
+	}
+
+	list_append(&c->lru, &e->le, e);
+	memcpy(e->ha1, ha1, MD5_SIZE);
+	e->expires = expires;
+	e->gen     = gen;
+}
+
+
+static void ha1cache_flush(struct ha1cache *c)
+{
+	hash_flush(c->ht);
+	list_init(&c->lru);
+	c->count = 0;
+}
 
 
 static const char *mknonce(char *nonce, time_t now, const struct sa *src)
@@ -139,6 +254,86 @@ static bool sharedsecret_auth_calc_ha1(const struct stun_attr *user, const uint8
 	return true;
 }
 
+static time_t sharedsecret_expires(const char *username)
+{
+	long ts = 0;
+
+	if (sscanf(username, "%ld", &ts) != 1)
+		return 0;
+
+	return ts;
+}
+
+
+static bool sharedsecret_auth_try(const struct stun_attr *user,
+				  const struct stun_msg *msg,
+				  const char *secret, size_t secret_length,
+				  uint8_t *key)
+{
+	return sharedsecret_auth_calc_ha1(user, (const uint8_t *)secret,
+					  secret_length, key) &&
+		!stun_msg_chk_mi(msg, key, MD5_SIZE);
+}
+
+
+/* HA1 from the cache or from the current or rollover secret */
+static bool sharedsecret_auth(const struct stun_attr *user,
+			      const struct stun_msg *msg, uint8_t *key,
+			      time_t now)
+{
+	struct ha1cache *c = ha1cache();
+	char s1[256], s2[256];
+	size_t l1, l2;
+	struct ha1ent *e;
+	time_t expires;
+	uint32_t gen;
+
+	if (c) {
+		e = ha1cache_find(c, user->v.username);
+
+		if (e && (e->gen != __atomic_load_n(&auth.gen,
+						    __ATOMIC_ACQUIRE) ||
+			  now > e->expires)) {
+			ha1ent_remove(c, e);
+			e = NULL;
+		}
+
+		if (e) {
+			memcpy(key, e->ha1, MD5_SIZE);
+
+			if (!stun_msg_chk_mi(msg, key, MD5_SIZE)) {
+				list_unlink(&e->le);
+				list_append(&c->lru, &e->le, e);
+				++c->hitc;
+				return true;
+			}
+		}
+
+		++c->missc;
+	}
+
+	/* secrets may be replaced on reload */
+	pthread_mutex_lock(&auth.mutex);
+	memcpy(s1, auth.sharedsecret, sizeof(s1));
+	memcpy(s2, auth.sharedsecret2, sizeof(s2));
+	l1  = auth.sharedsecret_length;
+	l2  = auth.sharedsecret2_length;
+	gen = __atomic_load_n(&auth.gen, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&auth.mutex);
+
+	if (!sharedsecret_auth_try(user, msg, s1, l1, key) &&
+	    !sharedsecret_auth_try(user, msg, s2, l2, key))
+		return false;
+
+	expires = sharedsecret_expires(user->v.username);
+
+	if (c && auth.cache_size && expires >= now)
+		ha1cache_add(c, user->v.username, key, expires, gen);
+
+	return true;
+}
+
+
 static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 			    const struct sa *src, const struct sa *dst,
 			    const struct stun_msg *msg)
@@ -149,9 +344,6 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 	int err;
 	(void)dst;
 
-	if (ctx->key)
-		return false;
-
 	mi    = stun_msg_attr(msg, STUN_ATTR_MSG_INTEGRITY);
 	user  = stun_msg_attr(msg, STUN_ATTR_USERNAME);
 	realm = stun_msg_attr(msg, STUN_ATTR_REALM);
@@ -185,6 +377,10 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 		goto unauth;
 	}
 
+	/* key already verified, e.g. against the key of an allocation */
+	if (ctx->key)
+		return false;
+
 	ctx->key = mem_alloc(MD5_SIZE, NULL);
 	if (!ctx->key) {
 		restund_warning("auth: can't to allocate memory for MI key\n");
@@ -197,12 +393,7 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 
 	ctx->keylen = MD5_SIZE;
 	if (auth.sharedsecret_length > 0 || auth.sharedsecret2_length > 0) {
-		if (!((sharedsecret_auth_calc_ha1(user, (uint8_t*) auth.sharedsecret, 
-                                auth.sharedsecret_length, ctx->key)
-			    && !stun_msg_chk_mi(msg, ctx->key, ctx->keylen))
-			|| (sharedsecret_auth_calc_ha1(user, (uint8_t*) auth.sharedsecret2,
-                                   auth.sharedsecret2_length, ctx->key)
-			   && !stun_msg_chk_mi(msg, ctx->key, ctx->keylen)))) {
+		if (!sharedsecret_auth(user, msg, ctx->key, now)) {
 			restund_info("auth: shared secret auth for user '%s' (%j) failed\n",
 				     user->v.username, src);
 			err = stun_ereply(proto, sock, src, 0, msg,
@@ -269,8 +460,78 @@ static struct restund_stun stun = {
 };
 
 
+/* re-read the shared secrets, cached HA1s of old secrets are dropped */
+static void reload_handler(struct mbuf *mb)
+{
+	char s1[256] = "", s2[256] = "";
+	(void)mb;
+
+	conf_get_str(restund_conf(), "auth_shared", s1, sizeof(s1));
+	conf_get_str(restund_conf(), "auth_shared_rollover", s2, sizeof(s2));
+
+	pthread_mutex_lock(&auth.mutex);
+
+	if (strcmp(s1, auth.sharedsecret) || strcmp(s2, auth.sharedsecret2)) {
+
+		memcpy(auth.sharedsecret, s1, sizeof(s1));
+		memcpy(auth.sharedsecret2, s2, sizeof(s2));
+		auth.sharedsecret_length  = strlen(s1);
+		auth.sharedsecret2_length = strlen(s2);
+		(void)__atomic_add_fetch(&auth.gen, 1, __ATOMIC_RELEASE);
+
+		restund_info("auth: shared secrets changed\n");
+	}
+
+	pthread_mutex_unlock(&auth.mutex);
+}
+
+
+static void cache_handler(struct mbuf *mb)
+{
+	uint64_t hitc = 0, missc = 0, evictc = 0;
+	uint32_t i, count = 0;
+
+	for (i=0; i<auth.cachec; i++) {
+		count  += auth.cachev[i].count;
+		hitc   += auth.cachev[i].hitc;
+		missc  += auth.cachev[i].missc;
+		evictc += auth.cachev[i].evictc;
+	}
+
+	(void)mbuf_printf(mb, "ha1 cache: %u entries (max %u per worker)"
+			  " hits %llu misses %llu evictions %llu\n",
+			  count, auth.cache_size, hitc, missc, evictc);
+}
+
+
+static struct restund_cmdsub cmd_reload = {
+	.cmdh = reload_handler,
+	.cmd  = "reload",
+};
+
+
+static struct restund_cmdsub cmd_auth = {
+	.cmdh = cache_handler,
+	.cmd  = "auth",
+};
+
+
+static void cachev_destructor(void *arg)
+{
+	struct ha1cache *cachev = arg;
+	uint32_t i;
+
+	for (i=0; i<auth.cachec; i++) {
+		ha1cache_flush(&cachev[i]);
+		mem_deref(cachev[i].ht);
+	}
+}
+
+
 static int module_init(void)
 {
+	uint32_t i;
+
 	auth.nonce_expiry = NONCE_EXPIRY;
 	auth.secret = rand_u64();
 
@@ -288,10 +549,32 @@ static int module_init(void)
                       auth.sharedsecret2_length);
     }
 
+	/* per event loop HA1 cache */
+	auth.cache_size = HA1_CACHE_SIZE;
+	conf_get_u32(restund_conf(), "auth_ha1_cache_size", &auth.cache_size);
+
+	auth.cachec = restund_worker_count();
+	auth.cachev = mem_zalloc(auth.cachec * sizeof(*auth.cachev),
+				 cachev_destructor);
+	if (!auth.cachev)
+		return ENOMEM;
+
+	for (i=0; i<auth.cachec; i++) {
+
+		int err = hash_alloc(&auth.cachev[i].ht,
+				     hash_valid_size(MAX(auth.cache_size, 1)));
+		if (err)
+			return err;
+
+		list_init(&auth.cachev[i].lru);
+	}
+
 	restund_stun_register_handler(&stun);
+	restund_cmd_subscribe(&cmd_reload);
+	restund_cmd_subscribe(&cmd_auth);
 
-	restund_debug("auth: module loaded (nonce_expiry=%us)\n",
-		      auth.nonce_expiry);
+	restund_debug("auth: module loaded (nonce_expiry=%us ha1_cache=%u)\n",
+		      auth.nonce_expiry, auth.cache_size);
 
 	return 0;
 }
@@ -299,8 +582,13 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	restund_cmd_unsubscribe(&cmd_auth);
+	restund_cmd_unsubscribe(&cmd_reload);
 	restund_stun_unregister_handler(&stun);
 
+	auth.cachev = mem_deref(auth.cachev);
+	auth.cachec = 0;
+
 	restund_debug("auth: module closed\n");
 
 	return 0;
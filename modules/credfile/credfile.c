@@ -0,0 +1,387 @@
+/**
+ * @file credfile.c Memory-mapped Credential File Backend
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <re.h>
+#include <restund.h>
+#include "credfile.h"
+
+
+/*
+ * The credential file (see credfile.h) is mapped read-only and looked up
+ * in place with a binary search, so loading takes the same time for any
+ * number of accounts. When the file is renamed into place (inotify) or
+ * on the "reload" command a new mapping is published; the old one is
+ * unmapped once no lookup can still use it.
+ */
+
+
+struct cfmap {
+	uint8_t *base;
+	size_t size;
+	const struct credfile_ent *entv;
+	const char *names;
+	uint32_t count;
+	uint32_t names_len;
+};
+
+
+static struct {
+	char path[256];
+	const char *file;
+	struct cfmap *map;
+	uint64_t loadc;
+	uint64_t errc;
+	int ifd;
+} cf = {
+	.ifd = -1,
+};
+
+
+static void cfmap_destructor(void *arg)
+{
+	struct cfmap *m = arg;
+
+	if (m->base)
+		(void)munmap(m->base, m->size);
+}
+
+
+static int cfmap_check(struct cfmap *m)
+{
+	const struct credfile_hdr *hdr = (void *)m->base;
+	const char *realm = restund_realm();
+	uint64_t index_off, index_len, names_off, realm_len;
+
+	if (m->size < sizeof(*hdr))
+		return EBADMSG;
+
+	if (credfile_le32(hdr->magic) != CREDFILE_MAGIC ||
+	    credfile_le32(hdr->version) != CREDFILE_VERSION)
+		return EBADMSG;
+
+	m->count     = credfile_le32(hdr->count);
+	m->names_len = credfile_le32(hdr->names_len);
+	realm_len    = credfile_le32(hdr->realm_len);
+	index_off    = credfile_le32(hdr->index_off);
+	names_off    = credfile_le32(hdr->names_off);
+	index_len    = (uint64_t)m->count * sizeof(struct credfile_ent);
+
+	if (sizeof(*hdr) + realm_len > m->size ||
+	    index_off % 4 || index_off + index_len > m->size ||
+	    names_off + m->names_len > m->size)
+		return EBADMSG;
+
+	if (realm_len != strlen(realm) ||
+	    memcmp(m->base + sizeof(*hdr), realm, realm_len)) {
+		restund_warning("credfile: %s: realm does not match '%s'\n",
+				cf.path, realm);
+		return EINVAL;
+	}
+
+	m->entv  = (void *)(m->base + index_off);
+	m->names = (const char *)m->base + names_off;
+
+	return 0;
+}
+
+
+static int cfmap_load(struct cfmap **mp, const char *path)
+{
+	struct cfmap *m;
+	struct stat st;
+	int fd, err;
+
+	m = mem_zalloc(sizeof(*m), cfmap_destructor);
+	if (!m)
+		return ENOMEM;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if (st.st_size <= 0) {
+		err = EBADMSG;
+		goto out;
+	}
+
+	m->base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+		       fd, 0);
+	if (m->base == MAP_FAILED) {
+		m->base = NULL;
+		err = errno;
+		goto out;
+	}
+
+	m->size = (size_t)st.st_size;
+
+#ifdef MADV_RANDOM
+	(void)madvise(m->base, m->size, MADV_RANDOM);
+#endif
+
+	err = cfmap_check(m);
+
+ out:
+	if (fd >= 0)
+		(void)close(fd);
+
+	if (err)
+		mem_deref(m);
+	else
+		*mp = m;
+
+	return err;
+}
+
+
+static int reload(void)
+{
+	struct cfmap *m = NULL, *old;
+	int err;
+
+	err = cfmap_load(&m, cf.path);
+	if (err) {
+		++cf.errc;
+		restund_warning("credfile: %s: %m\n", cf.path, err);
+		return err;
+	}
+
+	old = __atomic_exchange_n(&cf.map, m, __ATOMIC_SEQ_CST);
+
+	restund_rcu_synchronize();
+	mem_deref(old);
+
+	++cf.loadc;
+
+	restund_info("credfile: %s: %u accounts (%zu bytes)\n",
+		     cf.path, m->count, m->size);
+
+	return 0;
+}
+
+
+static int ha1_handler(const char *username, uint8_t *ha1)
+{
+	const struct cfmap *m;
+	uint32_t lo = 0, hi;
+	size_t len;
+
+	m = __atomic_load_n(&cf.map, __ATOMIC_SEQ_CST);
+	if (!m)
+		return ENOENT;
+
+	len = strlen(username);
+	hi  = m->count;
+
+	while (lo < hi) {
+
+		const uint32_t mid = lo + (hi - lo) / 2;
+		const struct credfile_ent *e = &m->entv[mid];
+		const uint32_t off = credfile_le32(e->name_off);
+		const uint16_t nl  = credfile_le16(e->name_len);
+		int r;
+
+		if ((uint64_t)off + nl > m->names_len)
+			return EBADMSG;
+
+		r = credfile_cmp(username, len, m->names + off, nl);
+		if (!r) {
+			memcpy(ha1, e->ha1, CREDFILE_HA1);
+			return 0;
+		}
+
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return ENOENT;
+}
+
+
+#ifdef __linux__
+static void inotify_handler(int flags, void *arg)
+{
+	uint8_t buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t n;
+	(void)arg;
+
+	if (!(flags & FD_READ))
+		return;
+
+	while ((n = read(cf.ifd, buf, sizeof(buf))) > 0) {
+
+		ssize_t off = 0;
+
+		while (off < n) {
+
+			const struct inotify_event *ev = (void *)(buf + off);
+
+			if (ev->len && !strcmp(ev->name, cf.file))
+				changed = true;
+
+			off += sizeof(*ev) + ev->len;
+		}
+	}
+
+	if (changed)
+		(void)reload();
+}
+
+
+static int watch_init(void)
+{
+	char dir[256];
+	char *slash;
+	int err;
+
+	str_ncpy(dir, cf.path, sizeof(dir));
+
+	slash = strrchr(dir, '/');
+	if (slash == dir)
+		slash[1] = '\0';
+	else if (slash)
+		*slash = '\0';
+	else
+		str_ncpy(dir, ".", sizeof(dir));
+
+	cf.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (cf.ifd < 0)
+		return errno;
+
+	if (inotify_add_watch(cf.ifd, dir,
+			      IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	err = fd_listen(cf.ifd, FD_READ, inotify_handler, NULL);
+
+ out:
+	if (err) {
+		(void)close(cf.ifd);
+		cf.ifd = -1;
+	}
+
+	return err;
+}
+#endif
+
+
+static void reload_handler(struct mbuf *mb)
+{
+	(void)mb;
+
+	(void)reload();
+}
+
+
+static void status_handler(struct mbuf *mb)
+{
+	const struct cfmap *m = cf.map;
+
+	(void)mbuf_printf(mb, "credfile %s: %u accounts, %zu bytes,"
+			  " loads %llu errors %llu\n",
+			  cf.path, m ? m->count : 0, m ? m->size : 0,
+			  cf.loadc, cf.errc);
+}
+
+
+static struct restund_cmdsub cmd_reload = {
+	.le   = LE_INIT,
+	.cmdh = reload_handler,
+	.cmd  = "reload",
+};
+
+static struct restund_cmdsub cmd_status = {
+	.le   = LE_INIT,
+	.cmdh = status_handler,
+	.cmd  = "credfile",
+};
+
+
+static int module_init(void)
+{
+	static struct restund_db db = {
+		.ha1h = ha1_handler,
+	};
+	const char *slash;
+
+	if (conf_get_str(restund_conf(), "credfile_path", cf.path,
+			 sizeof(cf.path))) {
+		restund_error("credfile: credfile_path not set\n");
+		return EINVAL;
+	}
+
+	slash = strrchr(cf.path, '/');
+	cf.file = slash ? slash + 1 : cf.path;
+
+	/* a missing file is loaded once it is renamed into place */
+	(void)reload();
+
+#ifdef __linux__
+	{
+		int err = watch_init();
+		if (err)
+			restund_warning("credfile: inotify: %m\n", err);
+	}
+#endif
+
+	restund_cmd_subscribe(&cmd_reload);
+	restund_cmd_subscribe(&cmd_status);
+	restund_db_set_handler(&db);
+
+	return 0;
+}
+
+
+static int module_close(void)
+{
+	struct cfmap *m;
+
+	if (cf.ifd >= 0) {
+		fd_close(cf.ifd);
+		(void)close(cf.ifd);
+		cf.ifd = -1;
+	}
+
+	restund_cmd_unsubscribe(&cmd_status);
+	restund_cmd_unsubscribe(&cmd_reload);
+
+	m = __atomic_exchange_n(&cf.map, NULL, __ATOMIC_SEQ_CST);
+	restund_rcu_synchronize();
+	mem_deref(m);
+
+	restund_debug("credfile: module closed\n");
+
+	return 0;
+}
+
+
+const struct mod_export exports = {
+	.name  = "credfile",
+	.type  = "database client",
+	.init  = module_init,
+	.close = module_close,
+};
@@ -0,0 +1,76 @@
+/**
+ * @file credfile.h Credential File Format
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+/*
+ * A credential file holds the accounts of one realm, all integers are
+ * little endian:
+ *
+ *   struct credfile_hdr
+ *   realm       realm_len bytes, padded to 8
+ *   index       count x struct credfile_ent, sorted by credfile_cmp()
+ *   names       usernames, not terminated
+ *
+ * A new file must be written under a temporary name and renamed into
+ * place, a mapped file is never modified.
+ */
+
+
+enum {
+	CREDFILE_MAGIC   = 0x44524352,  /* "RCRD" */
+	CREDFILE_VERSION = 1,
+	CREDFILE_HA1     = 16,
+};
+
+
+struct credfile_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t realm_len;
+	uint32_t index_off;
+	uint32_t names_off;
+	uint32_t names_len;
+	uint32_t reserved;
+};
+
+struct credfile_ent {
+	uint32_t name_off;   /* relative to names_off */
+	uint16_t name_len;
+	uint16_t reserved;
+	uint8_t ha1[CREDFILE_HA1];
+};
+
+
+static inline uint32_t credfile_le32(uint32_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_bswap32(v);
+#else
+	return v;
+#endif
+}
+
+
+static inline uint16_t credfile_le16(uint16_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_bswap16(v);
+#else
+	return v;
+#endif
+}
+
+
+static inline int credfile_cmp(const char *a, size_t al,
+			       const char *b, size_t bl)
+{
+	int r = memcmp(a, b, al < bl ? al : bl);
+
+	if (r)
+		return r;
+
+	return al < bl ? -1 : al > bl;
+}
@@ -0,0 +1,310 @@
+/**
+ * @file mkcredfile.c Build a credential file from CSV
+ *
+ * Copyright (C) 2010 Creytiv.com
+ *
+ * usage: mkcredfile -r <realm> <input.csv> <output>
+ *
+ * Every input line is "username,ha1" with the HA1 as 32 hex digits;
+ * empty lines and lines starting with '#' are skipped. The output is
+ * written to "<output>.tmp" and renamed into place.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "credfile.h"
+
+
+struct acc {
+	uint32_t name_off;
+	uint16_t name_len;
+	uint8_t ha1[CREDFILE_HA1];
+};
+
+
+static struct {
+	struct acc *accv;
+	size_t accc;
+	size_t accsz;
+	char *names;
+	size_t names_len;
+	size_t names_sz;
+} b;
+
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+
+static int add(const char *name, size_t len, const char *hex)
+{
+	struct acc *acc;
+	size_t i;
+
+	if (!len || len > 0xffff || strlen(hex) != 2 * CREDFILE_HA1)
+		return EINVAL;
+
+	if (b.accc == b.accsz) {
+		size_t sz = b.accsz ? 2 * b.accsz : 1024;
+		struct acc *accv = realloc(b.accv, sz * sizeof(*accv));
+		if (!accv)
+			return ENOMEM;
+
+		b.accv  = accv;
+		b.accsz = sz;
+	}
+
+	if (b.names_len + len > b.names_sz) {
+		size_t sz = b.names_sz ? 2 * b.names_sz : 65536;
+		char *names;
+
+		while (sz < b.names_len + len)
+			sz *= 2;
+
+		if (sz > 0xffffffffu)
+			return EOVERFLOW;
+
+		names = realloc(b.names, sz);
+		if (!names)
+			return ENOMEM;
+
+		b.names    = names;
+		b.names_sz = sz;
+	}
+
+	acc = &b.accv[b.accc];
+
+	for (i=0; i<CREDFILE_HA1; i++) {
+		int hi = hexval(hex[2*i]), lo = hexval(hex[2*i + 1]);
+
+		if (hi < 0 || lo < 0)
+			return EINVAL;
+
+		acc->ha1[i] = (uint8_t)(hi << 4 | lo);
+	}
+
+	acc->name_off = (uint32_t)b.names_len;
+	acc->name_len = (uint16_t)len;
+
+	memcpy(b.names + b.names_len, name, len);
+	b.names_len += len;
+	++b.accc;
+
+	return 0;
+}
+
+
+static int acc_cmp(const void *p1, const void *p2)
+{
+	const struct acc *a1 = p1, *a2 = p2;
+
+	return credfile_cmp(b.names + a1->name_off, a1->name_len,
+			    b.names + a2->name_off, a2->name_len);
+}
+
+
+/* input order breaks ties, so the sort is stable */
+static int sort_cmp(const void *p1, const void *p2)
+{
+	const struct acc *a1 = p1, *a2 = p2;
+	int r = acc_cmp(p1, p2);
+
+	if (r)
+		return r;
+
+	return a1->name_off < a2->name_off ? -1 : 1;
+}
+
+
+static int read_csv(FILE *f)
+{
+	char line[1024];
+	unsigned lineno = 0;
+	int err;
+
+	while (fgets(line, sizeof(line), f)) {
+
+		char *sep;
+		size_t n;
+
+		++lineno;
+
+		n = strlen(line);
+		while (n && (line[n-1] == '\n' || line[n-1] == '\r'))
+			line[--n] = '\0';
+
+		if (!n || line[0] == '#')
+			continue;
+
+		sep = strrchr(line, ',');
+		if (!sep) {
+			fprintf(stderr, "line %u: missing ','\n", lineno);
+			return EINVAL;
+		}
+
+		err = add(line, (size_t)(sep - line), sep + 1);
+		if (err) {
+			fprintf(stderr, "line %u: %s\n", lineno,
+				strerror(err));
+			return err;
+		}
+	}
+
+	return ferror(f) ? EIO : 0;
+}
+
+
+static size_t pad8(size_t n)
+{
+	return (n + 7) & ~(size_t)7;
+}
+
+
+static int write_file(FILE *f, const char *realm)
+{
+	static const uint8_t zero[8];
+	struct credfile_hdr hdr;
+	size_t realm_len = strlen(realm), i, count = 0;
+	size_t index_off = pad8(sizeof(hdr) + realm_len);
+
+	/* the first account of a username wins */
+	for (i=0; i<b.accc; i++) {
+
+		if (count && !acc_cmp(&b.accv[count-1], &b.accv[i])) {
+			fprintf(stderr, "duplicate username '%.*s' skipped\n",
+				(int)b.accv[i].name_len,
+				b.names + b.accv[i].name_off);
+			continue;
+		}
+
+		b.accv[count++] = b.accv[i];
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic     = credfile_le32(CREDFILE_MAGIC);
+	hdr.version   = credfile_le32(CREDFILE_VERSION);
+	hdr.count     = credfile_le32((uint32_t)count);
+	hdr.realm_len = credfile_le32((uint32_t)realm_len);
+	hdr.index_off = credfile_le32((uint32_t)index_off);
+	hdr.names_off = credfile_le32((uint32_t)(index_off + count *
+						 sizeof(struct credfile_ent)));
+	hdr.names_len = credfile_le32((uint32_t)b.names_len);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(realm, 1, realm_len, f) != realm_len ||
+	    fwrite(zero, 1, index_off - sizeof(hdr) - realm_len, f)
+	    != index_off - sizeof(hdr) - realm_len)
+		return EIO;
+
+	for (i=0; i<count; i++) {
+
+		struct credfile_ent ent;
+
+		memset(&ent, 0, sizeof(ent));
+		ent.name_off = credfile_le32(b.accv[i].name_off);
+		ent.name_len = credfile_le16(b.accv[i].name_len);
+		memcpy(ent.ha1, b.accv[i].ha1, sizeof(ent.ha1));
+
+		if (fwrite(&ent, sizeof(ent), 1, f) != 1)
+			return EIO;
+	}
+
+	if (b.names_len && fwrite(b.names, b.names_len, 1, f) != 1)
+		return EIO;
+
+	printf("%zu accounts\n", count);
+
+	return 0;
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: mkcredfile -r <realm> <input.csv> <output>\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *realm = NULL;
+	char tmp[1024];
+	FILE *in, *out;
+	int c, err;
+
+	while ((c = getopt(argc, argv, "r:h")) != -1) {
+
+		switch (c) {
+
+		case 'r':
+			realm = optarg;
+			break;
+
+		default:
+			usage();
+			return 2;
+		}
+	}
+
+	if (!realm || argc - optind != 2) {
+		usage();
+		return 2;
+	}
+
+	in = fopen(argv[optind], "r");
+	if (!in) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	err = read_csv(in);
+	(void)fclose(in);
+	if (err)
+		return 1;
+
+	qsort(b.accv, b.accc, sizeof(*b.accv), sort_cmp);
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", argv[optind + 1])
+	    >= (int)sizeof(tmp)) {
+		fprintf(stderr, "%s: path too long\n", argv[optind + 1]);
+		return 1;
+	}
+
+	out = fopen(tmp, "wb");
+	if (!out) {
+		perror(tmp);
+		return 1;
+	}
+
+	err = write_file(out, realm);
+	if (fflush(out) || fsync(fileno(out)))
+		err = err ? err : EIO;
+	if (fclose(out))
+		err = err ? err : EIO;
+
+	if (!err && rename(tmp, argv[optind + 1]))
+		err = EIO;
+
+	if (err) {
+		fprintf(stderr, "%s: write failed\n", argv[optind + 1]);
+		(void)unlink(tmp);
+		return 1;
+	}
+
+	free(b.accv);
+	free(b.names);
+
+	return 0;
+}
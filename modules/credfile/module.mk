@@ -0,0 +1,11 @@
+#
+# module.mk
+#
+# Copyright (C) 2010 Creytiv.com
+#
+
+MOD		:= credfile
+$(MOD)_SRCS	+= credfile.c
+$(MOD)_LFLAGS	+=
+
+include mk/mod.mk
@@ -16,6 +16,53 @@
 #define ER_NO_REFERENCED_ROW_2 1452
 #endif
 
+#if defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 80001 && \
+	!defined(MARIADB_BASE_VERSION)
+typedef bool my_bool;
+#endif
+
+
+/*
+ * The account queries and the traffic log use server-side prepared
+ * statements. They are prepared on first use and closed whenever the
+ * connection is re-established. Traffic records are written with
+ * multi-row INSERTs of TLOG_ROWS records, the rest row by row, all in
+ * one transaction. If the server has gone away the batch is retried once
+ * on a new connection, otherwise it stays queued in the core.
+ *
+ * Results of prepared statements are not buffered by the client library:
+ * rows are streamed from the connection as they are fetched, like with
+ * mysql_use_result(). With mysql_fetch_rows set, the account list is
+ * read through a server-side cursor in batches of that many rows.
+ */
+
+
+enum {
+	TLOG_ROWS   = 32,
+	TLOG_PARAMS = 11,
+	ADDR_SIZE   = 64,
+	NAME_SIZE   = 256,
+	HA1_SIZE    = 65,
+};
+
+
+struct stmt {
+	MYSQL_STMT *st;
+	const char *sql;
+};
+
+struct tlogrow {
+	char cli[ADDR_SIZE];
+	char relay[ADDR_SIZE];
+	char peer[ADDR_SIZE];
+	unsigned long usrl;
+	unsigned long clil;
+	unsigned long relayl;
+	unsigned long peerl;
+	long long start;
+	long long end;
+};
+
 
 static struct {
 	char host[128];
@@ -24,9 +71,24 @@ static struct {
 	char db[128];
 	MYSQL mysql;
 	uint32_t version;  /* SER Version, e.g. 1, 2 or 3 */
+	uint32_t fetch_rows;
+	struct stmt acc_all;
+	struct stmt acc_cnt;
+	struct stmt acc_delta;
+	struct stmt tlog1;
+	struct stmt tlogn;
+	char *tlog1_sql;
+	char *tlogn_sql;
+	struct tlogrow rowv[TLOG_ROWS];
+	MYSQL_BIND tlogv[TLOG_ROWS * TLOG_PARAMS];
 } my;
 
 
+static struct stmt *stmtv[] = {
+	&my.acc_all, &my.acc_cnt, &my.acc_delta, &my.tlog1, &my.tlogn
+};
+
+
 static int myconnect(void)
 {
 	mysql_init(&my.mysql);
@@ -43,6 +105,42 @@ static int myconnect(void)
 }
 
 
+static void stmts_close(void)
+{
+	size_t i;
+
+	for (i=0; i<ARRAY_SIZE(stmtv); i++) {
+
+		if (!stmtv[i]->st)
+			continue;
+
+		(void)mysql_stmt_close(stmtv[i]->st);
+		stmtv[i]->st = NULL;
+	}
+}
+
+
+static bool conn_lost(unsigned int errnum)
+{
+	return errnum == CR_SERVER_GONE_ERROR || errnum == CR_SERVER_LOST;
+}
+
+
+static int reconnect(void)
+{
+	int err;
+
+	stmts_close();
+	mysql_close(&my.mysql);
+
+	err = myconnect();
+	if (err)
+		restund_error("mysql: %s\n", mysql_error(&my.mysql));
+
+	return err;
+}
+
+
 static int query(MYSQL_RES **res, const char *fmt, ...)
 {
 	bool failed = false;
@@ -76,13 +174,10 @@ static int query(MYSQL_RES **res, const char *fmt, ...)
 	case CR_SERVER_GONE_ERROR:
 	case CR_SERVER_LOST:
 		failed = true;
-		mysql_close(&my.mysql);
 
-		err = myconnect();
-		if (err) {
-			restund_error("mysql: %s\n", mysql_error(&my.mysql));
+		err = reconnect();
+		if (err)
 			break;
-		}
 
 		goto retry;
 
@@ -95,46 +190,260 @@ static int query(MYSQL_RES **res, const char *fmt, ...)
 }
 
 
+/* execute a statement once, *lost is set if the connection is gone */
+static int stmt_run(MYSQL_STMT **stp, struct stmt *s, MYSQL_BIND *param,
+		    MYSQL_BIND *res, bool *lost)
+{
+	MYSQL_STMT *st = s->st;
+
+	*lost = false;
+
+	if (!st) {
+		st = mysql_stmt_init(&my.mysql);
+		if (!st)
+			return ENOMEM;
+
+		if (mysql_stmt_prepare(st, s->sql, strlen(s->sql))) {
+			restund_warning("mysql: prepare: %s\n",
+					mysql_stmt_error(st));
+			*lost = conn_lost(mysql_stmt_errno(st));
+			(void)mysql_stmt_close(st);
+			return EIO;
+		}
+
+		if (s == &my.acc_all && my.fetch_rows) {
+			const unsigned long type = CURSOR_TYPE_READ_ONLY;
+			const unsigned long rows = my.fetch_rows;
+
+			(void)mysql_stmt_attr_set(st, STMT_ATTR_CURSOR_TYPE,
+						  &type);
+			(void)mysql_stmt_attr_set(st, STMT_ATTR_PREFETCH_ROWS,
+						  &rows);
+		}
+
+		s->st = st;
+	}
+
+	if ((param && mysql_stmt_bind_param(st, param)) ||
+	    mysql_stmt_execute(st) ||
+	    (res && mysql_stmt_bind_result(st, res))) {
+		restund_warning("mysql: execute: %s\n", mysql_stmt_error(st));
+		*lost = conn_lost(mysql_stmt_errno(st));
+		return EIO;
+	}
+
+	if (stp)
+		*stp = st;
+
+	return 0;
+}
+
+
+static int stmt_exec(MYSQL_STMT **stp, struct stmt *s, MYSQL_BIND *param,
+		     MYSQL_BIND *res)
+{
+	bool lost;
+	int err;
+
+	err = stmt_run(stp, s, param, res, &lost);
+	if (err && lost && !reconnect())
+		err = stmt_run(stp, s, param, res, &lost);
+
+	return err;
+}
+
+
+static void bind_str(MYSQL_BIND *b, const char *str, unsigned long *len)
+{
+	*len = (unsigned long)strlen(str);
+
+	memset(b, 0, sizeof(*b));
+	b->buffer_type   = MYSQL_TYPE_STRING;
+	b->buffer        = (void *)str;
+	b->buffer_length = *len;
+	b->length        = len;
+}
+
+
+static void bind_u64(MYSQL_BIND *b, const uint64_t *v)
+{
+	memset(b, 0, sizeof(*b));
+	b->buffer_type = MYSQL_TYPE_LONGLONG;
+	b->buffer      = (void *)v;
+	b->is_unsigned = 1;
+}
+
+
+static void bind_i64(MYSQL_BIND *b, long long *v)
+{
+	memset(b, 0, sizeof(*b));
+	b->buffer_type = MYSQL_TYPE_LONGLONG;
+	b->buffer      = v;
+}
+
+
+static void bind_out(MYSQL_BIND *b, char *buf, size_t sz,
+		     unsigned long *len, my_bool *is_null)
+{
+	memset(b, 0, sizeof(*b));
+	b->buffer_type   = MYSQL_TYPE_STRING;
+	b->buffer        = buf;
+	b->buffer_length = sz;
+	b->length        = len;
+	b->is_null       = is_null;
+}
+
+
+static const char *out_str(char *buf, size_t sz, unsigned long len,
+			   my_bool is_null)
+{
+	if (is_null)
+		return NULL;
+
+	buf[MIN(len, sz - 1)] = '\0';
+
+	return buf;
+}
+
+
 static int accounts_getall(const char *realm, restund_db_account_h *acch,
 			   void *arg)
 {
-	MYSQL_RES *res;
-	int err = 0;
+	char name[NAME_SIZE], ha1[HA1_SIZE];
+	unsigned long realml, namel, ha1l;
+	my_bool name_null, ha1_null;
+	MYSQL_BIND param[1], res[2];
+	uint32_t rowc = 0, truncc = 0;
+	uint64_t start, ms;
+	MYSQL_STMT *st;
+	int err;
 
 	if (!realm || !acch)
 		return EINVAL;
 
-	switch (my.version) {
+	start = tmr_jiffies();
 
-	case 2:
-		err = query(&res,
-			    "SELECT auth_username, ha1 "
-			    "FROM credentials WHERE realm = '%s';",
-			    realm);
-		break;
+	bind_str(&param[0], realm, &realml);
+	bind_out(&res[0], name, sizeof(name), &namel, &name_null);
+	bind_out(&res[1], ha1, sizeof(ha1), &ha1l, &ha1_null);
 
-	default:
-		err = query(&res,
-			    "SELECT username, ha1 "
-			    "FROM subscriber where domain = '%s';",
-			    realm);
-		break;
+	err = stmt_exec(&st, &my.acc_all, param, res);
+	if (err) {
+		restund_warning("mysql: unable to select accounts\n");
+		return err;
 	}
 
+	while (!err) {
+		const char *u, *h;
+
+		switch (mysql_stmt_fetch(st)) {
+
+		case 0:
+			break;
+
+		case MYSQL_NO_DATA:
+			goto out;
+
+		case MYSQL_DATA_TRUNCATED:
+			++truncc;
+			continue;
+
+		default:
+			restund_warning("mysql: fetch accounts: %s\n",
+					mysql_stmt_error(st));
+			err = EIO;
+			goto out;
+		}
+
+		u = out_str(name, sizeof(name), namel, name_null);
+		h = out_str(ha1, sizeof(ha1), ha1l, ha1_null);
+
+		err = acch(u ? u : "", h ? h : "", arg);
+		++rowc;
+	}
+
+ out:
+	(void)mysql_stmt_free_result(st);
+
+	if (truncc)
+		restund_warning("mysql: %u accounts skipped (too long)\n",
+				truncc);
+
+	ms = tmr_jiffies() - start;
+
+	restund_info("mysql: fetched %u accounts in %llu ms (%llu rows/s)\n",
+		     rowc, ms, rowc * 1000ULL / MAX(ms, 1));
+
+	return err;
+}
+
+
+static int accounts_count(const char *realm, uint32_t *n)
+{
+	MYSQL_BIND param[1], res[1];
+	unsigned long realml;
+	MYSQL_STMT *st;
+	uint64_t cnt = 0;
+	int err;
+
+	if (!realm || !n)
+		return EINVAL;
+
+	bind_str(&param[0], realm, &realml);
+	bind_u64(&res[0], &cnt);
+
+	err = stmt_exec(&st, &my.acc_cnt, param, res);
 	if (err) {
-		restund_warning("mysql: unable to select accounts: %s\n",
-				mysql_error(&my.mysql));
+		restund_warning("mysql: unable to select nr of accounts\n");
 		return err;
 	}
 
+	if (mysql_stmt_fetch(st) == 0)
+		*n = (uint32_t)cnt;
+	else
+		err = ENOENT;
+
+	(void)mysql_stmt_free_result(st);
+
+	return err;
+}
+
+
+/* optional per-user relay limits */
+static int limits_getall(const char *realm, restund_db_limit_h *limh,
+			 void *arg)
+{
+	MYSQL_RES *res;
+	int err;
+
+	if (!realm || !limh)
+		return EINVAL;
+
+	err = query(&res,
+		    "SELECT username, bps, pps "
+		    "FROM turn_limits WHERE realm = '%s';",
+		    realm);
+	if (err) {
+		restund_debug("mysql: unable to select limits: %s\n",
+			      mysql_error(&my.mysql));
+		return 0;
+	}
+
 	for (;!err;) {
+		struct restund_limits lim;
 		MYSQL_ROW row;
 
 		row = mysql_fetch_row(res);
 		if (!row)
 			break;
 
-		err = acch(row[0] ? row[0] : "", row[1] ? row[1] : "", arg);
+		if (!row[0])
+			continue;
+
+		lim.bps = row[1] ? atoi(row[1]) : 0;
+		lim.pps = row[2] ? atoi(row[2]) : 0;
+
+		err = limh(row[0], &lim, arg);
 	}
 
 	mysql_free_result(res);
@@ -143,45 +452,231 @@ static int accounts_getall(const char *realm, restund_db_account_h *acch,
 }
 
 
-static int accounts_count(const char *realm, uint32_t *n)
+/*
+ * Optional account change log for delta sync. The table 'turn_cred_log'
+ * has an AUTO_INCREMENT id and the columns realm, username and ha1, with
+ * ha1 NULL for a deleted account. It is filled by triggers on the
+ * account table, the id is used as version.
+ */
+static int accounts_delta(const char *realm, uint64_t *version,
+			  restund_db_account_h *acch, void *arg)
 {
-	MYSQL_RES *res;
-	MYSQL_ROW row;
-	int err = 0;
+	char name[NAME_SIZE], ha1[HA1_SIZE];
+	unsigned long realml, namel, ha1l;
+	my_bool name_null, ha1_null;
+	MYSQL_BIND param[2], res[3];
+	uint64_t id = 0, after;
+	MYSQL_STMT *st;
+	MYSQL_RES *mres;
+	int err;
 
-	if (!realm || !n)
+	if (!realm || !version)
 		return EINVAL;
 
-	switch (my.version) {
+	if (!acch) {
+		MYSQL_ROW row;
 
-	case 2:
-		err = query(&res,
-			    "SELECT COUNT(*) "
-			    "FROM credentials WHERE realm = '%s';",
-			    realm);
-		break;
+		err = query(&mres, "SELECT MAX(id) FROM turn_cred_log;");
+		if (err) {
+			restund_debug("mysql: unable to select change log:"
+				      " %s\n", mysql_error(&my.mysql));
+			return ENOSYS;
+		}
 
-	default:
-		err = query(&res,
-			    "SELECT COUNT(*) "
-			    "FROM subscriber where domain = '%s';",
-			    realm);
-		break;
+		row = mysql_fetch_row(mres);
+		*version = (row && row[0]) ? strtoull(row[0], NULL, 10) : 0;
+
+		mysql_free_result(mres);
+
+		return 0;
 	}
 
+	after = *version;
+
+	bind_str(&param[0], realm, &realml);
+	bind_u64(&param[1], &after);
+	bind_u64(&res[0], &id);
+	bind_out(&res[1], name, sizeof(name), &namel, &name_null);
+	bind_out(&res[2], ha1, sizeof(ha1), &ha1l, &ha1_null);
+
+	err = stmt_exec(&st, &my.acc_delta, param, res);
 	if (err) {
-		restund_warning("mysql: unable to select nr of accounts: %s\n",
-				mysql_error(&my.mysql));
+		restund_warning("mysql: unable to select account changes\n");
 		return err;
 	}
 
-	row = mysql_fetch_row(res);
-	if (row)
-		*n = atoi(row[0]);
-	else
-		err = ENOENT;
+	while (!err) {
+		const char *u;
 
-	mysql_free_result(res);
+		switch (mysql_stmt_fetch(st)) {
+
+		case 0:
+			break;
+
+		case MYSQL_NO_DATA:
+			goto out;
+
+		case MYSQL_DATA_TRUNCATED:
+			/* the change is lost unless a full sync applies it */
+			restund_warning("mysql: account change %llu skipped"
+					" (too long)\n", id);
+			err = EOVERFLOW;
+			goto out;
+
+		default:
+			restund_warning("mysql: fetch account changes: %s\n",
+					mysql_stmt_error(st));
+			err = EIO;
+			goto out;
+		}
+
+		u = out_str(name, sizeof(name), namel, name_null);
+		if (!u)
+			continue;
+
+		err = acch(u, out_str(ha1, sizeof(ha1), ha1l, ha1_null), arg);
+		if (!err)
+			*version = id;
+	}
+
+ out:
+	(void)mysql_stmt_free_result(st);
+
+	return err;
+}
+
+
+static void tlog_bind(MYSQL_BIND *b, struct tlogrow *row,
+		      const struct restund_traffic *tr, const char *realm,
+		      unsigned long *realml)
+{
+	(void)re_snprintf(row->cli, sizeof(row->cli), "%J", &tr->cli);
+	(void)re_snprintf(row->relay, sizeof(row->relay), "%J", &tr->relay);
+	(void)re_snprintf(row->peer, sizeof(row->peer), "%J", &tr->peer);
+
+	row->start = tr->start;
+	row->end   = tr->end;
+
+	bind_str(&b[0], realm, realml);
+	bind_str(&b[1], tr->username, &row->usrl);
+	bind_str(&b[2], row->cli, &row->clil);
+	bind_str(&b[3], row->relay, &row->relayl);
+	bind_str(&b[4], row->peer, &row->peerl);
+	bind_i64(&b[5], &row->start);
+	bind_i64(&b[6], &row->end);
+	bind_u64(&b[7], &tr->ts.pktc_tx);
+	bind_u64(&b[8], &tr->ts.pktc_rx);
+	bind_u64(&b[9], &tr->ts.bytc_tx);
+	bind_u64(&b[10], &tr->ts.bytc_rx);
+}
+
+
+static int tlog_write(const char *realm, const struct restund_traffic *trv,
+		      size_t trc, bool *lost)
+{
+	unsigned long realml;
+	size_t i = 0, j, n;
+	int err = 0;
+
+	*lost = false;
+
+	if (mysql_query(&my.mysql, "START TRANSACTION")) {
+		*lost = conn_lost(mysql_errno(&my.mysql));
+		return EIO;
+	}
+
+	while (i < trc) {
+
+		struct stmt *s;
+
+		if (trc - i >= TLOG_ROWS) {
+			n = TLOG_ROWS;
+			s = &my.tlogn;
+		}
+		else {
+			n = 1;
+			s = &my.tlog1;
+		}
+
+		for (j=0; j<n; j++)
+			tlog_bind(&my.tlogv[j * TLOG_PARAMS], &my.rowv[j],
+				  &trv[i + j], realm, &realml);
+
+		err = stmt_run(NULL, s, my.tlogv, NULL, lost);
+		if (err)
+			goto out;
+
+		i += n;
+	}
+
+	if (mysql_commit(&my.mysql)) {
+		*lost = conn_lost(mysql_errno(&my.mysql));
+		err = EIO;
+	}
+
+ out:
+	if (err && !*lost)
+		(void)mysql_rollback(&my.mysql);
+
+	return err;
+}
+
+
+/*
+ * Traffic records go to the table 'turn_traffic' with the columns realm,
+ * username, client, relay, peer, start_time, end_time, pkt_tx, pkt_rx,
+ * byte_tx and byte_rx.
+ */
+static int traffic_log(const char *realm, const struct restund_traffic *trv,
+		       size_t trc)
+{
+	bool lost;
+	int err;
+
+	if (!realm || !trv)
+		return EINVAL;
+
+	if (!trc)
+		return 0;
+
+	err = tlog_write(realm, trv, trc, &lost);
+	if (err && lost && !reconnect())
+		err = tlog_write(realm, trv, trc, &lost);
+
+	if (err)
+		restund_warning("mysql: unable to log %zu traffic records:"
+				" %s\n", trc, mysql_error(&my.mysql));
+
+	return err;
+}
+
+
+static int tlog_sql(char **sqlp, uint32_t rows)
+{
+	struct mbuf *mb;
+	uint32_t i;
+	int err;
+
+	mb = mbuf_alloc(1024);
+	if (!mb)
+		return ENOMEM;
+
+	err = mbuf_printf(mb, "INSERT INTO turn_traffic (realm, username,"
+			  " client, relay, peer, start_time, end_time,"
+			  " pkt_tx, pkt_rx, byte_tx, byte_rx) VALUES ");
+
+	for (i=0; i<rows && !err; i++)
+		err = mbuf_printf(mb, "%s(?, ?, ?, ?, ?, FROM_UNIXTIME(?),"
+				  " FROM_UNIXTIME(?), ?, ?, ?, ?)",
+				  i ? ", " : "");
+	if (err)
+		goto out;
+
+	mb->pos = 0;
+	err = mbuf_strdup(mb, sqlp, mb->end);
+
+ out:
+	mem_deref(mb);
 
 	return err;
 }
@@ -191,15 +686,64 @@ static int module_init(void)
 {
 	static struct restund_db db = {
 		.allh  = accounts_getall,
-		.cnth  = accounts_count,
+		.cnth  = NULL,
 		.tlogh = NULL,
+		.limh  = limits_getall,
+		.deltah = accounts_delta,
 	};
+	struct pl opt;
+	int err;
 
 	conf_get_str(restund_conf(), "mysql_host", my.host, sizeof(my.host));
 	conf_get_str(restund_conf(), "mysql_user", my.user, sizeof(my.user));
 	conf_get_str(restund_conf(), "mysql_pass", my.pass, sizeof(my.pass));
 	conf_get_str(restund_conf(), "mysql_db",   my.db,   sizeof(my.db));
 	conf_get_u32(restund_conf(), "mysql_ser", &my.version);
+	conf_get_u32(restund_conf(), "mysql_fetch_rows", &my.fetch_rows);
+
+	/* the account count only presizes the table */
+	db.cnth = accounts_count;
+	if (!conf_get(restund_conf(), "mysql_count", &opt) &&
+	    !pl_strcasecmp(&opt, "no"))
+		db.cnth = NULL;
+
+	switch (my.version) {
+
+	case 2:
+		my.acc_all.sql = "SELECT auth_username, ha1 "
+			"FROM credentials WHERE realm = ?";
+		my.acc_cnt.sql = "SELECT COUNT(*) "
+			"FROM credentials WHERE realm = ?";
+		break;
+
+	default:
+		my.acc_all.sql = "SELECT username, ha1 "
+			"FROM subscriber WHERE domain = ?";
+		my.acc_cnt.sql = "SELECT COUNT(*) "
+			"FROM subscriber WHERE domain = ?";
+		break;
+	}
+
+	my.acc_delta.sql = "SELECT id, username, ha1 FROM turn_cred_log "
+		"WHERE realm = ? AND id > ? ORDER BY id";
+
+	/* traffic logging */
+	db.tlogbh = NULL;
+	if (!conf_get(restund_conf(), "mysql_traffic", &opt) &&
+	    !pl_strcasecmp(&opt, "yes")) {
+
+		err = tlog_sql(&my.tlog1_sql, 1);
+		if (!err)
+			err = tlog_sql(&my.tlogn_sql, TLOG_ROWS);
+		if (err) {
+			restund_error("mysql: traffic log: %m\n", err);
+			return err;
+		}
+
+		my.tlog1.sql = my.tlog1_sql;
+		my.tlogn.sql = my.tlogn_sql;
+		db.tlogbh = traffic_log;
+	}
 
 	if (myconnect()) {
 		restund_error("mysql: %s\n", mysql_error(&my.mysql));
@@ -213,8 +757,13 @@ static int module_init(void)
 
 static int module_close(void)
 {
+	stmts_close();
 	mysql_close(&my.mysql);
 
+	my.tlog1.sql = my.tlogn.sql = NULL;
+	my.tlog1_sql = mem_deref(my.tlog1_sql);
+	my.tlogn_sql = mem_deref(my.tlogn_sql);
+
 	restund_debug("mysql: module closed\n");
 
 	return 0;
@@ -17,7 +17,10 @@
  */
 
 
-#define STAT_INC(var)         ++(stat.var)           /**< Stats inc */
+/* requests are counted on all worker threads */
+#define STAT_INC(var) \
+	(void)__atomic_add_fetch(&stat.var, 1, __ATOMIC_RELAXED)
+#define STAT_GET(var) __atomic_load_n(&stat.var, __ATOMIC_RELAXED)
 
 
 static struct {
@@ -72,11 +75,12 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 
 static void print_stat(struct mbuf *mb)
 {
-	(void)mbuf_printf(mb, "binding_req %u\n", stat.n_bind_req);
-	(void)mbuf_printf(mb, "allocate_req %u\n", stat.n_alloc_req);
-	(void)mbuf_printf(mb, "refresh_req %u\n", stat.n_refresh_req);
-	(void)mbuf_printf(mb, "chanbind_req %u\n", stat.n_chanbind_req);
-	(void)mbuf_printf(mb, "unknown_req %u\n", stat.n_unk_req);
+	(void)mbuf_printf(mb, "binding_req %u\n", STAT_GET(n_bind_req));
+	(void)mbuf_printf(mb, "allocate_req %u\n", STAT_GET(n_alloc_req));
+	(void)mbuf_printf(mb, "refresh_req %u\n", STAT_GET(n_refresh_req));
+	(void)mbuf_printf(mb, "chanbind_req %u\n",
+			  STAT_GET(n_chanbind_req));
+	(void)mbuf_printf(mb, "unknown_req %u\n", STAT_GET(n_unk_req));
 }
 
 
@@ -5,6 +5,8 @@
  */
 
 #include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <re.h>
 #include <restund.h>
 #include "turn.h"
@@ -13,7 +15,6 @@
 enum {
 	PERM_HASH_SIZE = 16,
 	CHAN_HASH_SIZE = 16,
-	PORT_TRY_MAX = 32,
 	TCP_MAX_TXQSZ  = 8192,
 };
 
@@ -48,21 +49,72 @@ static const struct sa *relay_addr(const struct turnd *turnd, uint8_t af)
 }
 
 
+/* the tables are kept with a pooled allocation until it is freed */
 static void destructor(void *arg)
 {
 	struct allocation *al = arg;
 
-	hash_flush(al->perms);
 	mem_deref(al->perms);
 	mem_deref(al->chans);
+}
+
+
+void allocation_release(struct allocation *al)
+{
+	if (!al)
+		return;
+
+	perm_flush(al->perms);
+	chanlist_flush(al->chans);
 	restund_debug("turn: allocation %p destroyed\n", al);
-	hash_unlink(&al->he);
-	tmr_cancel(&al->tmr);
+	atab_remove(al->shard->atab, al);
+	wtmr_cancel(&al->tmr);
+	if (al->quota) {
+		quota_release(al->username, &al->cli_addr);
+		al->shard->allocc_cur--;
+	}
 	mem_deref(al->username);
+	mem_deref(al->mi_key);
+	mem_deref(al->mi_nonce);
 	mem_deref(al->cli_sock);
+	mem_deref(al->rel_ub);
 	mem_deref(al->rel_us);
 	mem_deref(al->rsv_us);
-	turndp()->allocc_cur--;
+
+	/* ports are returned once the sockets are closed */
+	if (al->rel_us)
+		portpool_put(turn_portpool(&al->rel_addr),
+			     sa_port(&al->rel_addr));
+	if (al->rsv_us)
+		portpool_put(turn_portpool(&al->rsv_addr),
+			     sa_port(&al->rsv_addr));
+
+	limit_detach(al);
+
+	pool_put(&al->shard->pool_alloc, al, &al->ple);
+}
+
+
+static struct allocation *allocation_get(struct turn_shard *shard)
+{
+	struct allocation *al;
+	struct chanlist *chans;
+	struct hash *perms;
+
+	al = pool_get(&shard->pool_alloc, sizeof(*al), destructor);
+	if (!al)
+		return NULL;
+
+	perms = al->perms;
+	chans = al->chans;
+
+	memset(al, 0, sizeof(*al));
+
+	al->perms = perms;
+	al->chans = chans;
+	al->shard = shard;
+
+	return al;
 }
 
 
@@ -71,7 +123,32 @@ static void timeout(void *arg)
 	struct allocation *al = arg;
 
 	restund_debug("turn: allocation %p expired\n", al);
-	mem_deref(al);
+	allocation_release(al);
+}
+
+
+/* ChannelData to a plain TCP client, sent from the receive buffer */
+static int chan_sendv(struct allocation *al, struct chan *chan,
+		      struct mbuf *mb)
+{
+	static const uint8_t pad[3];
+	const size_t len = mbuf_get_left(mb);
+	struct iovec iov[3];
+	uint8_t hdr[4];
+
+	hdr[0] = chan_numb(chan) >> 8;
+	hdr[1] = chan_numb(chan) & 0xff;
+	hdr[2] = len >> 8;
+	hdr[3] = len & 0xff;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len  = sizeof(hdr);
+	iov[1].iov_base = mbuf_buf(mb);
+	iov[1].iov_len  = len;
+	iov[2].iov_base = (void *)pad;
+	iov[2].iov_len  = (4 - (len & 0x03)) & 0x03;
+
+	return restund_tcp_sendv(al->cli_sock, iov, iov[2].iov_len ? 3 : 2);
 }
 
 
@@ -96,8 +173,16 @@ static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 		return;
 	}
 
+	if (!limit_check(al, mbuf_get_left(mb))) {
+		++al->dropc_rx;
+		return;
+	}
+
 	chan = chan_peer_find(al->chans, src);
-	if (chan) {
+	if (chan && al->gather) {
+		err = chan_sendv(al, chan, mb);
+	}
+	else if (chan) {
 		uint16_t len = mbuf_get_left(mb);
 		size_t start;
 
@@ -120,7 +205,12 @@ static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 		}
 
 		mb->pos = start;
-		err = stun_send(al->proto, al->cli_sock, &al->cli_addr, mb);
+		if (al->proto == IPPROTO_UDP)
+			err = restund_udp_batch_send(al->cli_sock,
+						     &al->cli_addr, mb);
+		else
+			err = stun_send(al->proto, al->cli_sock,
+					&al->cli_addr, mb);
 		mb->pos += 4;
 	}
 	else {
@@ -133,65 +223,73 @@ static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 
  out:
 	if (err)
-		turndp()->errc_rx++;
+		al->shard->errc_rx++;
 	else {
 		const size_t bytes = mbuf_get_left(mb);
 
 		perm_rx_stat(perm, bytes);
-		turndp()->bytec_rx += bytes;
+		al->shard->bytec_rx += bytes;
 	}
 }
 
 
-static int relay_listen(const struct sa *rel_addr, struct allocation *al,
-			const struct stun_even_port *even)
+/* socket options common to all relay sockets */
+void relay_sock_setup(struct udp_sock *us)
 {
-	uint32_t i;
-	int err = 0;
-
-	for (i=0; i<PORT_TRY_MAX; i++) {
+	udp_rxbuf_presz_set(us, 4);
+	if (turndp()->udp_sockbuf_size > 0)
+		(void)udp_sockbuf_set(us, turndp()->udp_sockbuf_size);
+}
 
-		err = udp_listen(&al->rel_us, rel_addr, udp_recv, al);
-		if (err)
-			break;
 
-		err = udp_local_get(al->rel_us, &al->rel_addr);
-		if (err) {
-			al->rel_us = mem_deref(al->rel_us);
-			break;
-		}
+static int relay_listen(const struct sa *rel_addr, struct allocation *al,
+			const struct stun_even_port *even)
+{
+	enum port_type type = PORT_ANY;
+	int err;
 
-		if (!even)
-			break;
+	if (even)
+		type = even->r ? PORT_PAIR : PORT_EVEN;
 
-		restund_debug("turn: try#%u: %J\n", i, &al->rel_addr);
+	/* pre-bound socket, unless a port pair must be reserved */
+	if (type != PORT_PAIR &&
+	    !warm_take(al->shard, rel_addr, type == PORT_EVEN,
+		       &al->rel_us, &al->rel_addr)) {
+		udp_handler_set(al->rel_us, udp_recv, al);
+		return 0;
+	}
 
-		if (sa_port(&al->rel_addr) & 0x1) {
-			al->rel_us = mem_deref(al->rel_us);
-			continue;
-		}
+	err = portpool_listen(turn_portpool(rel_addr), type, rel_addr,
+			      &al->rel_addr, &al->rel_us, &al->rsv_us,
+			      udp_recv, al);
+	if (err)
+		return err;
 
-		if (!even->r)
-			break;
+	relay_sock_setup(al->rel_us);
 
+	if (al->rsv_us) {
 		al->rsv_addr = al->rel_addr;
 		sa_set_port(&al->rsv_addr, sa_port(&al->rel_addr) + 1);
-
-		err = udp_listen(&al->rsv_us, &al->rsv_addr, NULL, NULL);
-		if (err) {
-			al->rel_us = mem_deref(al->rel_us);
-			continue;
-		}
-		break;
 	}
 
-	return (i == PORT_TRY_MAX) ? EADDRINUSE : err;
+	return 0;
+}
+
+
+static void relay_setup(struct allocation *al)
+{
+	/* batched receive, falls back to one datagram per wakeup */
+	if (restund_udp_batch_size() &&
+	    restund_udp_batch_alloc(&al->rel_ub, al->rel_us, &al->rel_addr,
+				    udp_recv, al, &al->shard->batch)) {
+		restund_debug("turn: relay batch unavailable (%J)\n",
+			      &al->rel_addr);
+	}
 }
 
 
-static bool rsvt_handler(struct le *le, void *arg)
+static bool rsvt_handler(const struct allocation *al, void *arg)
 {
-	struct allocation *al = le->data;
 	uint64_t rsvt = *(uint64_t *)arg;
 
 	if (sa_stunaf(&al->rsv_addr) != ((rsvt >> 24) & 0xff))
@@ -204,18 +302,18 @@ static bool rsvt_handler(struct le *le, void *arg)
 }
 
 
-static int rsvt_listen(const struct hash *ht, struct allocation *al,
-		      uint64_t rsvt)
+static int rsvt_listen(struct atab *atab, struct allocation *al,
+		       uint64_t rsvt)
 {
 	struct allocation *alr;
 
-	alr = list_ledata(hash_lookup(ht, (uint32_t)(rsvt >> 32),
-				      rsvt_handler, &rsvt));
+	alr = atab_lookup(atab, (uint32_t)(rsvt >> 32), rsvt_handler, &rsvt);
 	if (!alr)
 		return ENOENT;
 
 	al->rel_us = alr->rsv_us;
 	udp_handler_set(al->rel_us, udp_recv, al);
+	relay_sock_setup(al->rel_us);
 	alr->rsv_us = NULL;
 	al->rel_addr = alr->rsv_addr;
 	sa_init(&alr->rsv_addr, AF_UNSPEC);
@@ -241,7 +339,7 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 	if (alx) {
 		if (!memcmp(alx->tid, stun_msg_tid(msg), sizeof(alx->tid)) &&
 		    proto == IPPROTO_UDP) {
-			lifetime = (uint32_t)(tmr_get_expire(&alx->tmr)/1000);
+			lifetime = (uint32_t)(wtmr_get_expire(&alx->tmr)/1000);
 			goto reply;
 		}
 
@@ -323,7 +421,7 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 	lifetime = MIN(lifetime, turnd->lifetime_max);
 
 	/* Create allocation state */
-	al = mem_zalloc(sizeof(*al), destructor);
+	al = allocation_get(turn_shard());
 	if (!al) {
 		restund_warning("turn: no memory for allocation\n");
 		rerr = stun_ereply(proto, sock, src, 0, msg,
@@ -333,21 +431,58 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 		goto out;
 	}
 
-	hash_append(turnd->ht_alloc, sa_hash(src, SA_ALL), &al->he, al);
-	tmr_start(&al->tmr, lifetime * 1000, timeout, al);
+	wtmr_start(&al->shard->wheel, &al->tmr, lifetime * 1000, timeout, al);
 	attr = stun_msg_attr(msg, STUN_ATTR_USERNAME);
 	al->username = mem_ref(attr ? attr->v.username : NULL);
+	al->mi_key    = mem_ref(ctx->key);
+	al->mi_keylen = ctx->keylen;
+	attr = stun_msg_attr(msg, STUN_ATTR_NONCE);
+	al->mi_nonce  = mem_ref(attr ? attr->v.nonce : NULL);
+	limit_attach(al);
 	memcpy(al->tid, stun_msg_tid(msg), sizeof(al->tid));
 	al->cli_sock = mem_ref(sock);
+	al->gather   = proto == IPPROTO_TCP && restund_tcp_gather(sock);
 	al->cli_addr = *src;
 	al->srv_addr = *dst;
 	al->proto = proto;
 	sa_init(&al->rsv_addr, AF_UNSPEC);
-	turndp()->allocc_tot++;
-	turndp()->allocc_cur++;
+
+	/* Quotas */
+	err = quota_acquire(al->username, src);
+	if (err == EDQUOT) {
+		restund_info("turn: allocation quota reached (%J)\n", src);
+		rerr = stun_ereply(proto, sock, src, 0, msg,
+				   486, "Allocation Quota Reached",
+				   ctx->key, ctx->keylen, ctx->fp, 1,
+				   STUN_ATTR_SOFTWARE, restund_software);
+		goto out;
+	}
+	else if (err) {
+		restund_warning("turn: quota: %m\n", err);
+		rerr = stun_ereply(proto, sock, src, 0, msg,
+				   500, "Server Error",
+				   ctx->key, ctx->keylen, ctx->fp, 1,
+				   STUN_ATTR_SOFTWARE, restund_software);
+		goto out;
+	}
+
+	al->quota = true;
+	al->shard->allocc_tot++;
+	al->shard->allocc_cur++;
+
+	err = atab_insert(al->shard->atab, al, proto, src, dst);
+	if (err) {
+		restund_warning("turn: alloc table insert: %m\n", err);
+		rerr = stun_ereply(proto, sock, src, 0, msg,
+				   500, "Server Error",
+				   ctx->key, ctx->keylen, ctx->fp, 1,
+				   STUN_ATTR_SOFTWARE, restund_software);
+		goto out;
+	}
 
 	/* Permissions */
-	err = perm_hash_alloc(&al->perms, PERM_HASH_SIZE);
+	if (!al->perms)
+		err = perm_hash_alloc(&al->perms, PERM_HASH_SIZE);
 	if (err) {
 		restund_warning("turn: perm list alloc: %m\n", err);
 		rerr = stun_ereply(proto, sock, src, 0, msg,
@@ -358,7 +493,8 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 	}
 
 	/* Channels */
-	err = chanlist_alloc(&al->chans, CHAN_HASH_SIZE);
+	if (!al->chans)
+		err = chanlist_alloc(&al->chans, CHAN_HASH_SIZE);
 	if (err) {
 		restund_warning("turn: chan list alloc: %m\n", err);
 		rerr = stun_ereply(proto, sock, src, 0, msg,
@@ -370,7 +506,7 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 
 	/* Relay socket */
 	if (rsvt)
-		err = rsvt_listen(turnd->ht_alloc, al, rsvt->v.rsv_token);
+		err = rsvt_listen(al->shard->atab, al, rsvt->v.rsv_token);
 	else
 		err = relay_listen(rel_addr, al, even ? &even->v.even_port :
 				   NULL);
@@ -384,9 +520,7 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 		goto out;
 	}
 
-	udp_rxbuf_presz_set(al->rel_us, 4);
-	if (turndp()->udp_sockbuf_size > 0)
-		(void)udp_sockbuf_set(al->rel_us, turndp()->udp_sockbuf_size);
+	relay_setup(al);
 
 	restund_debug("turn: allocation %p created %s/%J/%J - %J (%us)\n",
 		      al, net_proto2name(al->proto), &al->cli_addr,
@@ -396,7 +530,7 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 
  reply:
 	if (alx->rsv_us) {
-		rsv  = (uint64_t)sa_hash(src, SA_ALL) << 32;
+		rsv  = (uint64_t)alx->hash << 32;
 		rsv |= (uint64_t)sa_stunaf(&alx->rsv_addr) << 24;
 		rsv += sa_port(&alx->rsv_addr);
 	}
@@ -413,7 +547,7 @@ void allocate_request(struct turnd *turnd, struct allocation *alx,
 		restund_warning("turn: allocate reply: %m\n", rerr);
 
 	if (err)
-		mem_deref(al);
+		allocation_release(al);
 }
 
 
@@ -441,7 +575,7 @@ void refresh_request(struct turnd *turnd, struct allocation *al,
 	lifetime = lifetime ? MAX(lifetime, TURN_DEFAULT_LIFETIME) : 0;
 	lifetime = MIN(lifetime, turnd->lifetime_max);
 
-	tmr_start(&al->tmr, lifetime * 1000, timeout, al);
+	wtmr_start(&al->shard->wheel, &al->tmr, lifetime * 1000, timeout, al);
 
 	restund_debug("turn: allocation %p refresh (%us)\n", al, lifetime);
 
@@ -0,0 +1,425 @@
+/**
+ * @file atab.c Turn Server Allocation Table
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <restund.h>
+#include "turn.h"
+
+
+/*
+ * Open-addressing table with linear probing, mapping the 5-tuple of an
+ * allocation to the allocation. Each slot holds the full hash and the
+ * allocation pointer, the packed key is stored in the allocation and
+ * only compared when the hash matches.
+ *
+ * When the table grows a new table is allocated and the entries are
+ * moved over a few slots at a time on every operation, so resizing
+ * never blocks the event loop. During the move lookups check both.
+ */
+
+
+enum {
+	ATAB_MIN  = 64,
+	ATAB_STEP = 32,
+};
+
+enum {
+	SLOT_EMPTY = 0,
+	SLOT_USED,
+	SLOT_DEL,
+};
+
+
+struct slot {
+	uint32_t hash;
+	uint32_t state;
+	struct allocation *al;
+};
+
+struct table {
+	struct slot *slotv;
+	uint32_t size;
+	uint32_t used;
+	uint32_t del;
+};
+
+struct atab {
+	struct table cur;
+	struct table old;
+	uint32_t migr;
+	uint32_t busy;
+	uint64_t rehashc;
+};
+
+
+static void destructor(void *arg)
+{
+	struct atab *t = arg;
+
+	mem_deref(t->cur.slotv);
+	mem_deref(t->old.slotv);
+}
+
+
+static void key_set(struct atab_key *key, int proto, const struct sa *cli,
+		    const struct sa *srv)
+{
+	memset(key, 0, sizeof(*key));
+
+	key->proto = proto;
+	key->af    = sa_af(cli);
+	key->cport = sa_port(cli);
+	key->sport = sa_port(srv);
+
+	switch (sa_af(cli)) {
+
+	case AF_INET:
+		memcpy(key->caddr, &cli->u.in.sin_addr, 4);
+		memcpy(key->saddr, &srv->u.in.sin_addr, 4);
+		break;
+
+#ifdef HAVE_INET6
+	case AF_INET6:
+		memcpy(key->caddr, &cli->u.in6.sin6_addr, 16);
+		memcpy(key->saddr, &srv->u.in6.sin6_addr, 16);
+		break;
+#endif
+	}
+}
+
+
+static inline uint32_t key_hash(const struct atab_key *key)
+{
+	return hash_joaat((const uint8_t *)key, sizeof(*key));
+}
+
+
+static int table_init(struct table *tb, uint32_t size)
+{
+	tb->slotv = mem_zalloc(size * sizeof(*tb->slotv), NULL);
+	if (!tb->slotv)
+		return ENOMEM;
+
+	tb->size = size;
+	tb->used = 0;
+	tb->del  = 0;
+
+	return 0;
+}
+
+
+static void table_put(struct table *tb, uint32_t hash, struct allocation *al)
+{
+	const uint32_t mask = tb->size - 1;
+	uint32_t i = hash & mask;
+
+	while (tb->slotv[i].state == SLOT_USED)
+		i = (i + 1) & mask;
+
+	if (tb->slotv[i].state == SLOT_DEL)
+		--tb->del;
+
+	tb->slotv[i].hash  = hash;
+	tb->slotv[i].state = SLOT_USED;
+	tb->slotv[i].al    = al;
+	++tb->used;
+}
+
+
+static struct slot *table_find(const struct table *tb, uint32_t hash,
+			       const struct allocation *al)
+{
+	uint32_t mask, i;
+
+	if (!tb->slotv)
+		return NULL;
+
+	mask = tb->size - 1;
+
+	for (i = hash & mask; tb->slotv[i].state != SLOT_EMPTY;
+	     i = (i + 1) & mask) {
+
+		struct slot *s = &tb->slotv[i];
+
+		if (s->state == SLOT_USED && s->al == al)
+			return s;
+	}
+
+	return NULL;
+}
+
+
+static struct allocation *table_lookup(const struct table *tb, uint32_t hash,
+				       atab_cmp_h *cmph, void *arg)
+{
+	uint32_t mask, i;
+
+	if (!tb->slotv)
+		return NULL;
+
+	mask = tb->size - 1;
+
+	for (i = hash & mask; tb->slotv[i].state != SLOT_EMPTY;
+	     i = (i + 1) & mask) {
+
+		const struct slot *s = &tb->slotv[i];
+
+		if (s->state != SLOT_USED || s->hash != hash)
+			continue;
+
+		if (cmph(s->al, arg))
+			return s->al;
+	}
+
+	return NULL;
+}
+
+
+/* move a few entries from the old table */
+static void step(struct atab *t, uint32_t n)
+{
+	if (!t->old.slotv || t->busy)
+		return;
+
+	while (n-- && t->migr < t->old.size) {
+
+		struct slot *s = &t->old.slotv[t->migr++];
+
+		if (s->state == SLOT_USED) {
+			table_put(&t->cur, s->hash, s->al);
+			s->state = SLOT_DEL;
+			--t->old.used;
+		}
+	}
+
+	if (t->migr < t->old.size)
+		return;
+
+	t->old.slotv = mem_deref(t->old.slotv);
+	memset(&t->old, 0, sizeof(t->old));
+	t->migr = 0;
+}
+
+
+static int resize(struct atab *t, uint32_t size)
+{
+	struct table tb;
+	int err;
+
+	/* finish a pending move first */
+	step(t, t->old.size);
+
+	err = table_init(&tb, size);
+	if (err)
+		return err;
+
+	t->old  = t->cur;
+	t->cur  = tb;
+	t->migr = 0;
+	++t->rehashc;
+
+	return 0;
+}
+
+
+int atab_alloc(struct atab **tp, uint32_t size)
+{
+	struct atab *t;
+	uint32_t sz = ATAB_MIN;
+	int err;
+
+	if (!tp)
+		return EINVAL;
+
+	t = mem_zalloc(sizeof(*t), destructor);
+	if (!t)
+		return ENOMEM;
+
+	/* room for size entries below the load limit */
+	while (sz < size * 2)
+		sz <<= 1;
+
+	err = table_init(&t->cur, sz);
+	if (err)
+		mem_deref(t);
+	else
+		*tp = t;
+
+	return err;
+}
+
+
+int atab_insert(struct atab *t, struct allocation *al, int proto,
+		const struct sa *cli, const struct sa *srv)
+{
+	struct table *tb;
+	int err;
+
+	if (!t || !al || !cli || !srv)
+		return EINVAL;
+
+	step(t, ATAB_STEP);
+
+	tb = &t->cur;
+
+	/* keep load (including deleted slots) below 3/4 */
+	if (!t->busy && (tb->used + tb->del + 1) * 4 > tb->size * 3) {
+
+		uint32_t size = tb->size;
+
+		if ((tb->used + 1) * 2 > size)
+			size <<= 1;
+
+		err = resize(t, size);
+		if (err)
+			return err;
+	}
+
+	key_set(&al->key, proto, cli, srv);
+	al->hash = key_hash(&al->key);
+
+	table_put(&t->cur, al->hash, al);
+
+	return 0;
+}
+
+
+void atab_remove(struct atab *t, struct allocation *al)
+{
+	struct table *tb = NULL;
+	struct slot *s;
+
+	if (!t || !al)
+		return;
+
+	s = table_find(&t->cur, al->hash, al);
+	if (s)
+		tb = &t->cur;
+	else if ((s = table_find(&t->old, al->hash, al)))
+		tb = &t->old;
+	else
+		return;
+
+	s->state = SLOT_DEL;
+	s->al    = NULL;
+	--tb->used;
+	++tb->del;
+}
+
+
+static bool key_cmp_handler(const struct allocation *al, void *arg)
+{
+	return !memcmp(&al->key, arg, sizeof(al->key));
+}
+
+
+struct allocation *atab_find(struct atab *t, int proto, const struct sa *cli,
+			     const struct sa *srv)
+{
+	struct allocation *al;
+	struct atab_key key;
+	uint32_t hash;
+
+	if (!t || !cli || !srv)
+		return NULL;
+
+	step(t, ATAB_STEP);
+
+	key_set(&key, proto, cli, srv);
+	hash = key_hash(&key);
+
+	al = table_lookup(&t->cur, hash, key_cmp_handler, &key);
+	if (!al)
+		al = table_lookup(&t->old, hash, key_cmp_handler, &key);
+
+	return al;
+}
+
+
+/* find an allocation with the given hash using a compare handler */
+struct allocation *atab_lookup(struct atab *t, uint32_t hash,
+			       atab_cmp_h *cmph, void *arg)
+{
+	struct allocation *al;
+
+	if (!t || !cmph)
+		return NULL;
+
+	al = table_lookup(&t->cur, hash, cmph, arg);
+	if (!al)
+		al = table_lookup(&t->old, hash, cmph, arg);
+
+	return al;
+}
+
+
+/* the handler may destroy the allocation, but must not create one */
+void atab_apply(struct atab *t, atab_apply_h *h, void *arg)
+{
+	struct table *tbv[2];
+	uint32_t i, j;
+
+	if (!t || !h)
+		return;
+
+	tbv[0] = &t->cur;
+	tbv[1] = &t->old;
+
+	++t->busy;
+
+	for (i=0; i<2; i++) {
+
+		for (j=0; j<tbv[i]->size; j++) {
+
+			struct slot *s = &tbv[i]->slotv[j];
+
+			if (s->state != SLOT_USED)
+				continue;
+
+			if (h(s->al, arg))
+				goto out;
+		}
+	}
+
+ out:
+	--t->busy;
+}
+
+
+static bool flush_handler(struct allocation *al, void *arg)
+{
+	(void)arg;
+
+	allocation_release(al);
+
+	return false;
+}
+
+
+void atab_flush(struct atab *t)
+{
+	atab_apply(t, flush_handler, NULL);
+}
+
+
+uint32_t atab_size(const struct atab *t)
+{
+	return t ? t->cur.size : 0;
+}
+
+
+void atab_status(const struct atab *t, struct mbuf *mb)
+{
+	if (!t || !mb)
+		return;
+
+	(void)mbuf_printf(mb, "- alloc table size %u used %u deleted %u"
+			  " (rehash %llu%s)\n",
+			  t->cur.size, t->cur.used + t->old.used,
+			  t->cur.del, t->rehashc,
+			  t->old.slotv ? ", moving" : "");
+}
@@ -4,7 +4,7 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
-#include <time.h>
+#include <string.h>
 #include <re.h>
 #include <restund.h>
 #include "turn.h"
@@ -24,35 +24,61 @@ struct chanlist {
 
 
 struct chan {
+	struct le ple;
 	struct le he_numb;
 	struct le he_peer;
 	struct sa peer;
 	const struct allocation *al;
-	time_t expires;
+	struct wtmr tmr;
 	uint16_t numb;
 };
 
 
+static void chan_release(struct chan *chan)
+{
+	if (!chan)
+		return;
+
+	restund_debug("turn: allocation %p channel 0x%x %J destroyed\n",
+		      chan->al, chan->numb, &chan->peer);
+
+	hash_unlink(&chan->he_numb);
+	hash_unlink(&chan->he_peer);
+	wtmr_cancel(&chan->tmr);
+	chan->al->shard->chan_cur--;
+
+	pool_put(&chan->al->shard->pool_chan, chan, &chan->ple);
+}
+
+
+static bool flush_handler(struct le *le, void *arg)
+{
+	(void)arg;
+
+	chan_release(le->data);
+
+	return false;
+}
+
+
 static void chanlist_destructor(void *arg)
 {
 	struct chanlist *cl = arg;
 
-	hash_flush(cl->ht_numb);
+	hash_apply(cl->ht_numb, flush_handler, NULL);
 	mem_deref(cl->ht_numb);
 	mem_deref(cl->ht_peer);
 }
 
 
-static void destructor(void *arg)
+static void timeout(void *arg)
 {
 	struct chan *chan = arg;
 
-	restund_debug("turn: allocation %p channel 0x%x %J destroyed\n",
+	restund_debug("turn: allocation %p channel 0x%x %J expired\n",
 		      chan->al, chan->numb, &chan->peer);
 
-	hash_unlink(&chan->he_numb);
-	hash_unlink(&chan->he_peer);
-    turndp()->chan_cur--;
+	chan_release(chan);
 }
 
 
@@ -75,47 +101,21 @@ static bool hash_peer_cmp_handler(struct le *le, void *arg)
 
 struct chan *chan_numb_find(const struct chanlist *cl, uint16_t numb)
 {
-	struct chan *chan;
-
 	if (!cl)
 		return NULL;
 
-	chan = list_ledata(hash_lookup(cl->ht_numb, numb,
+	return list_ledata(hash_lookup(cl->ht_numb, numb,
 				       hash_numb_cmp_handler, &numb));
-	if (!chan)
-		return NULL;
-
-	if (chan->expires < time(NULL)) {
-		restund_debug("turn: allocation %p channel 0x%x %J expired\n",
-			      chan->al, chan->numb, &chan->peer);
-		mem_deref(chan);
-		return NULL;
-	}
-
-	return chan;
 }
 
 
 struct chan *chan_peer_find(const struct chanlist *cl, const struct sa *peer)
 {
-	struct chan *chan;
-
 	if (!cl || !peer)
 		return NULL;
 
-	chan = list_ledata(hash_lookup(cl->ht_peer, sa_hash(peer, SA_ALL),
+	return list_ledata(hash_lookup(cl->ht_peer, sa_hash(peer, SA_ALL),
 				       hash_peer_cmp_handler, (void *)peer));
-	if (!chan)
-		return NULL;
-
-	if (chan->expires < time(NULL)) {
-		restund_debug("turn: allocation %p channel 0x%x %J expired\n",
-			      chan->al, chan->numb, &chan->peer);
-		mem_deref(chan);
-		return NULL;
-	}
-
-	return chan;
 }
 
 
@@ -161,13 +161,22 @@ int chanlist_alloc(struct chanlist **clp, uint32_t bsize)
 }
 
 
+void chanlist_flush(struct chanlist *cl)
+{
+	if (!cl)
+		return;
+
+	hash_apply(cl->ht_numb, flush_handler, NULL);
+}
+
+
 static bool status_handler(struct le *le, void *arg)
 {
 	struct chan *chan = le->data;
 	struct mbuf *mb = arg;
 
 	(void)mbuf_printf(mb, " (0x%x %J %is)", chan->numb, &chan->peer,
-			  chan->expires - time(NULL));
+			  (int)(wtmr_get_expire(&chan->tmr) / 1000));
 
 	return false;
 }
@@ -193,21 +202,25 @@ static struct chan *chan_create(struct chanlist *cl, uint16_t numb,
 	if (!cl || !peer)
 		return NULL;
 
-	chan = mem_zalloc(sizeof(*chan), destructor);
+	chan = pool_get(&al->shard->pool_chan, sizeof(*chan), NULL);
 	if (!chan)
 		return NULL;
 
+	memset(chan, 0, sizeof(*chan));
+
 	hash_append(cl->ht_numb, numb, &chan->he_numb, chan);
 	hash_append(cl->ht_peer, sa_hash(peer, SA_ALL), &chan->he_peer, chan);
 
 	chan->peer = *peer;
 	chan->numb = numb;
 	chan->al = al;
-	chan->expires = time(NULL) + CHAN_LIFETIME;
+
+	wtmr_start(&al->shard->wheel, &chan->tmr, CHAN_LIFETIME * 1000,
+		   timeout, chan);
 
 	restund_debug("turn: allocation %p channel 0x%x %J created\n",
 		      chan->al, chan->numb, &chan->peer);
-    turndp()->chan_cur++;
+	chan->al->shard->chan_cur++;
 
 	return chan;
 }
@@ -218,7 +231,8 @@ static void chan_refresh(struct chan *chan)
 	if (!chan)
 		return;
 
-	chan->expires = time(NULL) + CHAN_LIFETIME;
+	wtmr_start(&chan->al->shard->wheel, &chan->tmr, CHAN_LIFETIME * 1000,
+		   timeout, chan);
 
 	restund_debug("turn: allocation %p channel 0x%x %J refreshed\n",
 		      chan->al, chan->numb, &chan->peer);
@@ -308,8 +322,8 @@ void chanbind_request(struct allocation *al, struct restund_msgctx *ctx,
 		restund_warning("turn: chanbind reply: %m\n", rerr);
 
 	if (err) {
-		mem_deref(chan);
-		mem_deref(perm);
+		chan_release(chan);
+		perm_release(perm);
 	}
 	else {
 		chan_refresh(ch_numb);
@@ -0,0 +1,192 @@
+/**
+ * @file limit.c Turn Server Rate Limits
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <restund.h>
+#include "turn.h"
+
+
+/*
+ * Relayed traffic is limited by token buckets for bytes and packets per
+ * second, one pair per allocation and one pair per username. The user
+ * buckets are shared by the allocations of a user on the same worker.
+ * Limits from the database replace the configured ones for that user.
+ */
+
+
+struct ulimit {
+	struct le he;
+	struct limiter lim;
+	char *username;
+};
+
+
+static void tbucket_init(struct tbucket *tb, uint32_t rate, uint64_t now)
+{
+	tb->rate   = rate;
+	tb->tokens = (uint64_t)rate * 1000;
+	tb->ts     = now;
+}
+
+
+static void tbucket_refill(struct tbucket *tb, uint64_t now)
+{
+	const uint64_t max = (uint64_t)tb->rate * 1000;
+
+	if (now <= tb->ts)
+		return;
+
+	tb->tokens = MIN(max, tb->tokens + (now - tb->ts) * tb->rate);
+	tb->ts     = now;
+}
+
+
+void limiter_init(struct limiter *lim, const struct restund_limits *rl)
+{
+	const uint64_t now = tmr_jiffies();
+
+	tbucket_init(&lim->bytes, rl->bps, now);
+	tbucket_init(&lim->pkts,  rl->pps, now);
+}
+
+
+/* true if one packet of the given size is within the limit */
+static bool limiter_avail(struct limiter *lim, size_t bytes, uint64_t now)
+{
+	if (lim->bytes.rate) {
+		tbucket_refill(&lim->bytes, now);
+		if (lim->bytes.tokens < (uint64_t)bytes * 1000)
+			return false;
+	}
+
+	if (lim->pkts.rate) {
+		tbucket_refill(&lim->pkts, now);
+		if (lim->pkts.tokens < 1000)
+			return false;
+	}
+
+	return true;
+}
+
+
+static void limiter_debit(struct limiter *lim, size_t bytes)
+{
+	if (lim->bytes.rate)
+		lim->bytes.tokens -= (uint64_t)bytes * 1000;
+
+	if (lim->pkts.rate)
+		lim->pkts.tokens -= 1000;
+}
+
+
+static void ulimit_destructor(void *arg)
+{
+	struct ulimit *ul = arg;
+
+	hash_unlink(&ul->he);
+	mem_deref(ul->username);
+}
+
+
+static bool ulimit_cmp_handler(struct le *le, void *arg)
+{
+	const struct ulimit *ul = le->data;
+
+	return !strcmp(ul->username, arg);
+}
+
+
+static struct ulimit *ulimit_get(struct hash *ht, const char *username,
+				 const struct restund_limits *rl)
+{
+	const uint32_t key = hash_joaat_str(username);
+	struct ulimit *ul;
+
+	ul = list_ledata(hash_lookup(ht, key, ulimit_cmp_handler,
+				     (void *)username));
+	if (ul) {
+		/* limits may have changed in the database */
+		ul->lim.bytes.rate = rl->bps;
+		ul->lim.pkts.rate  = rl->pps;
+		return mem_ref(ul);
+	}
+
+	ul = mem_zalloc(sizeof(*ul), ulimit_destructor);
+	if (!ul)
+		return NULL;
+
+	if (str_dup(&ul->username, username)) {
+		mem_deref(ul);
+		return NULL;
+	}
+
+	limiter_init(&ul->lim, rl);
+	hash_append(ht, key, &ul->he, ul);
+
+	return ul;
+}
+
+
+static bool limits_set(const struct restund_limits *rl)
+{
+	return rl->bps || rl->pps;
+}
+
+
+void limit_attach(struct allocation *al)
+{
+	const struct turnd *turnd = turndp();
+	struct restund_limits alim = turnd->lim_alloc;
+	struct restund_limits ulim = turnd->lim_user;
+	struct restund_limits dbl;
+
+	if (al->username && !restund_get_limits(al->username, &dbl)) {
+		alim = dbl;
+		ulim = dbl;
+	}
+
+	limiter_init(&al->lim, &alim);
+	al->limited = limits_set(&alim);
+
+	if (al->username && limits_set(&ulim)) {
+
+		al->ul = ulimit_get(al->shard->ht_ulimit, al->username, &ulim);
+		if (al->ul)
+			al->limited = true;
+	}
+}
+
+
+void limit_detach(struct allocation *al)
+{
+	al->ul = mem_deref(al->ul);
+}
+
+
+/* true if a packet of the given size may be relayed */
+bool limit_check(struct allocation *al, size_t bytes)
+{
+	uint64_t now;
+
+	if (!al->limited)
+		return true;
+
+	now = tmr_jiffies();
+
+	/* a packet rejected by either bucket is charged to neither */
+	if (!limiter_avail(&al->lim, bytes, now))
+		return false;
+
+	if (al->ul && !limiter_avail(&al->ul->lim, bytes, now))
+		return false;
+
+	limiter_debit(&al->lim, bytes);
+	if (al->ul)
+		limiter_debit(&al->ul->lim, bytes);
+
+	return true;
+}
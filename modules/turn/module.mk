@@ -6,9 +6,16 @@
 
 MOD		:= turn
 $(MOD)_SRCS	+= alloc.c
+$(MOD)_SRCS	+= atab.c
 $(MOD)_SRCS	+= chan.c
+$(MOD)_SRCS	+= limit.c
 $(MOD)_SRCS	+= perm.c
+$(MOD)_SRCS	+= pool.c
+$(MOD)_SRCS	+= portpool.c
+$(MOD)_SRCS	+= quota.c
 $(MOD)_SRCS	+= turn.c
+$(MOD)_SRCS	+= warm.c
+$(MOD)_SRCS	+= wheel.c
 $(MOD)_LFLAGS	+=
 
 include mk/mod.mk
@@ -4,6 +4,7 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <string.h>
 #include <time.h>
 #include <re.h>
 #include <restund.h>
@@ -16,11 +17,12 @@ enum {
 
 
 struct perm {
+	struct le ple;
 	struct le he;
 	struct sa peer;
 	struct restund_trafstat ts;
 	const struct allocation *al;
-	time_t expires;
+	struct wtmr tmr;
 	time_t start;
 	bool new;
 };
@@ -33,12 +35,15 @@ struct createperm {
 };
 
 
-static void destructor(void *arg)
+void perm_release(struct perm *perm)
 {
-	struct perm *perm = arg;
 	int err;
 
+	if (!perm)
+		return;
+
 	hash_unlink(&perm->he);
+	wtmr_cancel(&perm->tmr);
 
 	restund_debug("turn: allocation %p permission %j destroyed "
 		      "(%llu/%llu %llu/%llu)\n",
@@ -46,15 +51,45 @@ static void destructor(void *arg)
 		      perm->ts.pktc_tx, perm->ts.pktc_rx,
 		      perm->ts.bytc_tx, perm->ts.bytc_rx);
 
-	if (!perm->ts.pktc_tx && !perm->ts.pktc_rx)
-		return;
+	if (perm->ts.pktc_tx || perm->ts.pktc_rx) {
 
-	err = restund_log_traffic(perm->al->username, &perm->al->cli_addr,
-				  &perm->al->rel_addr, &perm->peer,
-				  perm->start, time(NULL), &perm->ts);
-	if (err) {
-		restund_warning("traffic log error: %m\n", err);
+		err = restund_log_traffic(perm->al->username,
+					  &perm->al->cli_addr,
+					  &perm->al->rel_addr, &perm->peer,
+					  perm->start, time(NULL), &perm->ts);
+		if (err) {
+			restund_warning("traffic log error: %m\n", err);
+		}
 	}
+
+	pool_put(&perm->al->shard->pool_perm, perm, &perm->ple);
+}
+
+
+static bool flush_handler(struct le *le, void *arg)
+{
+	(void)arg;
+
+	perm_release(le->data);
+
+	return false;
+}
+
+
+void perm_flush(struct hash *ht)
+{
+	hash_apply(ht, flush_handler, NULL);
+}
+
+
+static void timeout(void *arg)
+{
+	struct perm *perm = arg;
+
+	restund_debug("turn: allocation %p permission %j expired\n",
+		      perm->al, &perm->peer);
+
+	perm_release(perm);
 }
 
 
@@ -68,24 +103,11 @@ static bool hash_cmp_handler(struct le *le, void *arg)
 
 struct perm *perm_find(const struct hash *ht, const struct sa *peer)
 {
-	struct perm *perm;
-
 	if (!ht || !peer)
 		return NULL;
 
-	perm = list_ledata(hash_lookup(ht, sa_hash(peer, SA_ADDR),
+	return list_ledata(hash_lookup(ht, sa_hash(peer, SA_ADDR),
 				       hash_cmp_handler, (void *)peer));
-	if (!perm)
-		return NULL;
-
-	if (perm->expires < time(NULL)) {
-		restund_debug("turn: allocation %p permission %j expired\n",
-			      perm->al, &perm->peer);
-		mem_deref(perm);
-		return NULL;
-	}
-
-	return perm;
 }
 
 
@@ -98,17 +120,21 @@ struct perm *perm_create(struct hash *ht, const struct sa *peer,
 	if (!ht || !peer || !al)
 		return NULL;
 
-	perm = mem_zalloc(sizeof(*perm), destructor);
+	perm = pool_get(&al->shard->pool_perm, sizeof(*perm), NULL);
 	if (!perm)
 		return NULL;
 
+	memset(perm, 0, sizeof(*perm));
+
 	hash_append(ht, sa_hash(peer, SA_ADDR), &perm->he, perm);
 
 	perm->peer = *peer;
 	perm->al = al;
-	perm->expires = now + PERM_LIFETIME;
 	perm->start = now;
 
+	wtmr_start(&al->shard->wheel, &perm->tmr, PERM_LIFETIME * 1000,
+		   timeout, perm);
+
 	restund_debug("turn: allocation %p permission %j created\n", al, peer);
 
 	return perm;
@@ -120,7 +146,8 @@ void perm_refresh(struct perm *perm)
 	if (!perm)
 		return;
 
-	perm->expires = time(NULL) + PERM_LIFETIME;
+	wtmr_start(&perm->al->shard->wheel, &perm->tmr, PERM_LIFETIME * 1000,
+		   timeout, perm);
 	restund_debug("turn: allocation %p permission %j refreshed\n",
 		      perm->al, &perm->peer);
 }
@@ -158,7 +185,7 @@ static bool status_handler(struct le *le, void *arg)
 	struct mbuf *mb = arg;
 
 	(void)mbuf_printf(mb, " (%j %is relay %llu/%llu)", &perm->peer,
-			  perm->expires - time(NULL),
+			  (int)(wtmr_get_expire(&perm->tmr) / 1000),
 			  perm->ts.pktc_tx, perm->ts.pktc_rx);
 
 	return false;
@@ -214,7 +241,7 @@ static bool rollback_handler(struct le *le, void *arg)
 	list_unlink(&perm->he);
 
 	if (perm->new)
-		mem_deref(perm);
+		perm_release(perm);
 	else
 		hash_append(al->perms, sa_hash(&perm->peer, SA_ADDR),
 			    &perm->he, perm);
@@ -0,0 +1,123 @@
+/**
+ * @file pool.c Turn Server Object Pools
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <re.h>
+#include <restund.h>
+#include "turn.h"
+
+
+/*
+ * Fixed-size object pools, one per object type and shard. Objects are
+ * libre mem objects with a single owner, which releases them with the
+ * release function of their type instead of mem_deref(). That function
+ * cleans the object up and hands it to pool_put(), which keeps it on the
+ * free list or frees it. pool_get() takes objects from the free list
+ * before allocating new ones. A mem destructor only runs when the memory
+ * is really freed.
+ *
+ * Unlike other mem objects, pooled objects must not be passed to
+ * mem_ref() or mem_deref() by anyone but the pool. An object returned
+ * with other references is reported and freed instead of being reused.
+ */
+
+
+void pool_init(struct pool *p, const char *name, uint32_t max)
+{
+	if (!p)
+		return;
+
+	list_init(&p->freel);
+	p->name   = name;
+	p->max    = max;
+	p->size   = 0;
+	p->used   = 0;
+	p->freec  = 0;
+	p->hiwat  = 0;
+	p->allocc = 0;
+	p->reusec = 0;
+}
+
+
+/* recycled objects are returned as they were put, the caller resets them */
+void *pool_get(struct pool *p, size_t size, mem_destroy_h *dh)
+{
+	struct le *le;
+	void *obj;
+
+	le = list_head(&p->freel);
+	if (le) {
+		obj = le->data;
+		list_unlink(le);
+		--p->freec;
+		++p->reusec;
+	}
+	else {
+		obj = mem_zalloc(size, dh);
+		if (!obj)
+			return NULL;
+
+		++p->allocc;
+	}
+
+	p->size  = size;
+	p->hiwat = MAX(p->hiwat, ++p->used);
+
+	return obj;
+}
+
+
+/* called by the release function once the object is cleaned up */
+void pool_put(struct pool *p, void *obj, struct le *le)
+{
+	--p->used;
+
+	if (mem_nrefs(obj) != 1) {
+		restund_warning("pool: %s object %p released with %u refs\n",
+				p->name, obj, mem_nrefs(obj));
+		mem_deref(obj);
+		return;
+	}
+
+	if (p->freec >= p->max) {
+		mem_deref(obj);
+		return;
+	}
+
+	list_append(&p->freel, le, obj);
+	++p->freec;
+}
+
+
+void pool_flush(struct pool *p)
+{
+	struct le *le;
+
+	if (!p)
+		return;
+
+	p->max = 0;
+
+	while ((le = list_head(&p->freel))) {
+
+		void *obj = le->data;
+
+		list_unlink(le);
+		--p->freec;
+		mem_deref(obj);
+	}
+}
+
+
+void pool_status(const struct pool *p, struct mbuf *mb)
+{
+	if (!p || !mb)
+		return;
+
+	(void)mbuf_printf(mb, "%-6s size %zu used %u hiwat %u free %u/%u"
+			  " (new %llu reuse %llu)\n",
+			  p->name, p->size, p->used, p->hiwat,
+			  p->freec, p->max, p->allocc, p->reusec);
+}
@@ -0,0 +1,376 @@
+/**
+ * @file portpool.c Turn Server Relay Port Pool
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <pthread.h>
+#include <re.h>
+#include <restund.h>
+#include "turn.h"
+
+
+/*
+ * Bitmap of free relay ports in [min, max], one per relay address and
+ * shared by all shards. Bit n stands for port base + n, where base is
+ * min rounded down to an even port, so even ports are even bits and a
+ * port pair never crosses a word.
+ *
+ * For each kind of request (any port, even port, even port + next port)
+ * a summary bitmap tells which words can satisfy it. A lookup scans at
+ * most a few summary words and never walks the port range.
+ */
+
+
+#define EVEN_MASK 0x5555555555555555ULL
+
+
+enum {
+	WORD_BITS = 64,
+};
+
+
+struct portpool {
+	pthread_mutex_t mutex;
+	uint64_t *mapv;
+	uint64_t *sumv[PORT_TYPES];
+	uint32_t nwords;
+	uint32_t nsum;
+	uint32_t size;
+	uint32_t freec;
+	uint16_t base;
+	uint16_t min;
+	uint16_t max;
+};
+
+
+static void destructor(void *arg)
+{
+	struct portpool *pp = arg;
+	int i;
+
+	for (i=0; i<PORT_TYPES; i++)
+		mem_deref(pp->sumv[i]);
+
+	mem_deref(pp->mapv);
+	pthread_mutex_destroy(&pp->mutex);
+}
+
+
+static inline uint64_t word_bits(uint64_t m, enum port_type type)
+{
+	switch (type) {
+
+	case PORT_EVEN:
+		return m & EVEN_MASK;
+
+	case PORT_PAIR:
+		return m & (m >> 1) & EVEN_MASK;
+
+	default:
+		return m;
+	}
+}
+
+
+static void word_update(struct portpool *pp, uint32_t w)
+{
+	const uint64_t bit = 1ULL << (w % WORD_BITS);
+	int i;
+
+	for (i=0; i<PORT_TYPES; i++) {
+
+		uint64_t *sum = &pp->sumv[i][w / WORD_BITS];
+
+		if (word_bits(pp->mapv[w], i))
+			*sum |= bit;
+		else
+			*sum &= ~bit;
+	}
+}
+
+
+static void bit_set(struct portpool *pp, uint32_t n, bool free)
+{
+	const uint32_t w = n / WORD_BITS;
+	const uint64_t bit = 1ULL << (n % WORD_BITS);
+
+	if (free)
+		pp->mapv[w] |= bit;
+	else
+		pp->mapv[w] &= ~bit;
+
+	word_update(pp, w);
+}
+
+
+/* find a word with room for type, starting at a random word */
+static bool word_find(const struct portpool *pp, enum port_type type,
+		      uint32_t *wp)
+{
+	const uint64_t *sumv = pp->sumv[type];
+	const uint32_t start = rand_u32() % pp->nwords;
+	uint32_t j;
+
+	for (j=0; j<=pp->nsum; j++) {
+
+		const uint32_t k = (start / WORD_BITS + j) % pp->nsum;
+		uint64_t bits = sumv[k];
+
+		if (j == 0)
+			bits &= ~0ULL << (start % WORD_BITS);
+		else if (j == pp->nsum)
+			bits &= ~(~0ULL << (start % WORD_BITS));
+
+		if (bits) {
+			*wp = k * WORD_BITS + __builtin_ctzll(bits);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+int portpool_alloc(struct portpool **ppp, uint16_t min, uint16_t max)
+{
+	struct portpool *pp;
+	uint32_t n;
+	int i, err = 0;
+
+	if (!ppp || !min || min > max)
+		return EINVAL;
+
+	pp = mem_zalloc(sizeof(*pp), destructor);
+	if (!pp)
+		return ENOMEM;
+
+	pthread_mutex_init(&pp->mutex, NULL);
+
+	pp->min  = min;
+	pp->max  = max;
+	pp->base = min & ~1;
+
+	pp->nwords = (max - pp->base) / WORD_BITS + 1;
+	pp->nsum   = (pp->nwords + WORD_BITS - 1) / WORD_BITS;
+
+	pp->mapv = mem_zalloc(pp->nwords * sizeof(uint64_t), NULL);
+	if (!pp->mapv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<PORT_TYPES; i++) {
+
+		pp->sumv[i] = mem_zalloc(pp->nsum * sizeof(uint64_t), NULL);
+		if (!pp->sumv[i]) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	for (n=min; n<=max; n++)
+		bit_set(pp, n - pp->base, true);
+
+	pp->size  = max - min + 1;
+	pp->freec = pp->size;
+
+ out:
+	if (err)
+		mem_deref(pp);
+	else
+		*ppp = pp;
+
+	return err;
+}
+
+
+/* PORT_PAIR takes an even port and the port above it */
+int portpool_get(struct portpool *pp, enum port_type type, uint16_t *port)
+{
+	uint64_t bits;
+	uint32_t w, n;
+	int err = 0;
+
+	if (!pp || !port || type >= PORT_TYPES)
+		return EINVAL;
+
+	pthread_mutex_lock(&pp->mutex);
+
+	if (!word_find(pp, type, &w)) {
+		err = ENOSPC;
+		goto out;
+	}
+
+	bits = word_bits(pp->mapv[w], type);
+	n = w * WORD_BITS + __builtin_ctzll(bits);
+
+	bit_set(pp, n, false);
+	--pp->freec;
+
+	if (type == PORT_PAIR) {
+		bit_set(pp, n + 1, false);
+		--pp->freec;
+	}
+
+	*port = pp->base + n;
+
+ out:
+	pthread_mutex_unlock(&pp->mutex);
+
+	return err;
+}
+
+
+void portpool_put(struct portpool *pp, uint16_t port)
+{
+	uint32_t n;
+
+	if (!pp || port < pp->min || port > pp->max)
+		return;
+
+	n = port - pp->base;
+
+	pthread_mutex_lock(&pp->mutex);
+
+	if (!(pp->mapv[n / WORD_BITS] & (1ULL << (n % WORD_BITS)))) {
+		bit_set(pp, n, true);
+		++pp->freec;
+	}
+
+	pthread_mutex_unlock(&pp->mutex);
+}
+
+
+void portpool_stat(struct portpool *pp, uint32_t *freec, uint32_t *usedc)
+{
+	uint32_t n;
+
+	if (!pp)
+		return;
+
+	pthread_mutex_lock(&pp->mutex);
+	n = pp->freec;
+	pthread_mutex_unlock(&pp->mutex);
+
+	if (freec)
+		*freec += n;
+
+	if (usedc)
+		*usedc += pp->size - n;
+}
+
+
+/* without a port range the kernel picks the port */
+static int ephemeral_listen(enum port_type type, const struct sa *rel_addr,
+			    struct sa *laddr, struct udp_sock **usp,
+			    struct udp_sock **rsvp, udp_recv_h *rh, void *arg)
+{
+	uint32_t i;
+	int err = 0;
+
+	for (i=0; i<PORT_TRY_MAX; i++) {
+
+		struct sa rsv;
+
+		err = udp_listen(usp, rel_addr, rh, arg);
+		if (err)
+			return err;
+
+		err = udp_local_get(*usp, laddr);
+		if (err) {
+			*usp = mem_deref(*usp);
+			return err;
+		}
+
+		if (type == PORT_ANY)
+			return 0;
+
+		if (sa_port(laddr) & 0x1) {
+			*usp = mem_deref(*usp);
+			continue;
+		}
+
+		if (type == PORT_EVEN)
+			return 0;
+
+		sa_cpy(&rsv, laddr);
+		sa_set_port(&rsv, sa_port(laddr) + 1);
+
+		err = udp_listen(rsvp, &rsv, NULL, NULL);
+		if (!err)
+			return 0;
+
+		*usp = mem_deref(*usp);
+	}
+
+	return EADDRINUSE;
+}
+
+
+/*
+ * Bind a UDP socket on a port from the pool, or on a kernel chosen port
+ * if there is no pool. For PORT_PAIR the port above it is bound too,
+ * without a receive handler, as a reservation. Ports that are in use by
+ * other processes are skipped.
+ */
+int portpool_listen(struct portpool *pp, enum port_type type,
+		    const struct sa *rel_addr, struct sa *laddr,
+		    struct udp_sock **usp, struct udp_sock **rsvp,
+		    udp_recv_h *rh, void *arg)
+{
+	uint16_t busyv[PORT_TRY_MAX];
+	uint32_t i, busyc = 0;
+	uint16_t port;
+	int err = EADDRINUSE;
+
+	if (!rel_addr || !laddr || !usp)
+		return EINVAL;
+
+	if (type == PORT_PAIR && !rsvp)
+		return EINVAL;
+
+	if (!pp)
+		return ephemeral_listen(type, rel_addr, laddr, usp, rsvp,
+					rh, arg);
+
+	for (i=0; i<PORT_TRY_MAX; i++) {
+
+		struct sa rsv;
+
+		err = portpool_get(pp, type, &port);
+		if (err)
+			break;
+
+		sa_cpy(laddr, rel_addr);
+		sa_set_port(laddr, port);
+
+		err = udp_listen(usp, laddr, rh, arg);
+		if (!err && type == PORT_PAIR) {
+
+			sa_cpy(&rsv, laddr);
+			sa_set_port(&rsv, port + 1);
+
+			err = udp_listen(rsvp, &rsv, NULL, NULL);
+			if (err)
+				*usp = mem_deref(*usp);
+		}
+
+		if (!err)
+			break;
+
+		restund_debug("turn: relay port %u busy (%m)\n", port, err);
+		busyv[busyc++] = port;
+		err = EADDRINUSE;
+	}
+
+	for (i=0; i<busyc; i++) {
+
+		portpool_put(pp, busyv[i]);
+
+		if (type == PORT_PAIR)
+			portpool_put(pp, busyv[i] + 1);
+	}
+
+	return err;
+}
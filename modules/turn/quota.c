@@ -0,0 +1,272 @@
+/**
+ * @file quota.c Turn Server Allocation Quotas
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include <re.h>
+#include <restund.h>
+#include "turn.h"
+
+
+/*
+ * Allocation counters per username, per client IP-address and in total,
+ * shared by all shards. A counter is only touched when an allocation is
+ * created or destroyed, never on the data path.
+ */
+
+
+enum {
+	QUOTA_HASH_SIZE = 1024,
+};
+
+
+struct qent {
+	struct le he;
+	struct sa addr;
+	char *username;
+	uint32_t n;
+};
+
+
+static struct {
+	pthread_mutex_t mutex;
+	struct hash *ht_user;
+	struct hash *ht_ip;
+	uint32_t max_total;
+	uint32_t max_user;
+	uint32_t max_ip;
+	uint32_t total;
+	uint32_t userc;
+	uint32_t ipc;
+	uint64_t rejc_total;
+	uint64_t rejc_user;
+	uint64_t rejc_ip;
+} quota = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static void qent_destructor(void *arg)
+{
+	struct qent *q = arg;
+
+	hash_unlink(&q->he);
+	mem_deref(q->username);
+}
+
+
+static bool user_cmp_handler(struct le *le, void *arg)
+{
+	const struct qent *q = le->data;
+
+	return !strcmp(q->username, arg);
+}
+
+
+static bool ip_cmp_handler(struct le *le, void *arg)
+{
+	const struct qent *q = le->data;
+
+	return sa_cmp(&q->addr, arg, SA_ADDR);
+}
+
+
+static struct qent *user_find(const char *username)
+{
+	return list_ledata(hash_lookup(quota.ht_user,
+				       hash_joaat_str(username),
+				       user_cmp_handler, (void *)username));
+}
+
+
+static struct qent *ip_find(const struct sa *addr)
+{
+	return list_ledata(hash_lookup(quota.ht_ip, sa_hash(addr, SA_ADDR),
+				       ip_cmp_handler, (void *)addr));
+}
+
+
+static struct qent *user_get(const char *username)
+{
+	struct qent *q = user_find(username);
+
+	if (q)
+		return q;
+
+	q = mem_zalloc(sizeof(*q), qent_destructor);
+	if (!q)
+		return NULL;
+
+	if (str_dup(&q->username, username)) {
+		mem_deref(q);
+		return NULL;
+	}
+
+	hash_append(quota.ht_user, hash_joaat_str(username), &q->he, q);
+	++quota.userc;
+
+	return q;
+}
+
+
+static struct qent *ip_get(const struct sa *addr)
+{
+	struct qent *q = ip_find(addr);
+
+	if (q)
+		return q;
+
+	q = mem_zalloc(sizeof(*q), qent_destructor);
+	if (!q)
+		return NULL;
+
+	q->addr = *addr;
+	hash_append(quota.ht_ip, sa_hash(addr, SA_ADDR), &q->he, q);
+	++quota.ipc;
+
+	return q;
+}
+
+
+/* entries are removed with their last allocation */
+static void qent_unused(struct qent *q, uint32_t *cnt)
+{
+	if (!q || q->n)
+		return;
+
+	--*cnt;
+	mem_deref(q);
+}
+
+
+static void qent_put(struct qent *q, uint32_t *cnt)
+{
+	if (!q || !q->n)
+		return;
+
+	--q->n;
+	qent_unused(q, cnt);
+}
+
+
+int quota_init(void)
+{
+	int err;
+
+	quota.max_total = 0;
+	quota.max_user  = 0;
+	quota.max_ip    = 0;
+
+	conf_get_u32(restund_conf(), "turn_quota_total", &quota.max_total);
+	conf_get_u32(restund_conf(), "turn_quota_user", &quota.max_user);
+	conf_get_u32(restund_conf(), "turn_quota_ip", &quota.max_ip);
+
+	err = hash_alloc(&quota.ht_user, QUOTA_HASH_SIZE);
+	if (err)
+		return err;
+
+	return hash_alloc(&quota.ht_ip, QUOTA_HASH_SIZE);
+}
+
+
+void quota_close(void)
+{
+	pthread_mutex_lock(&quota.mutex);
+	hash_flush(quota.ht_user);
+	hash_flush(quota.ht_ip);
+	quota.ht_user = mem_deref(quota.ht_user);
+	quota.ht_ip   = mem_deref(quota.ht_ip);
+	quota.total = quota.userc = quota.ipc = 0;
+	pthread_mutex_unlock(&quota.mutex);
+}
+
+
+/* count a new allocation, EDQUOT if a quota is reached */
+int quota_acquire(const char *username, const struct sa *cli)
+{
+	struct qent *qu = NULL, *qi = NULL;
+	int err = 0;
+
+	pthread_mutex_lock(&quota.mutex);
+
+	if (quota.max_total && quota.total >= quota.max_total) {
+		++quota.rejc_total;
+		err = EDQUOT;
+		goto out;
+	}
+
+	if (username) {
+		qu = user_get(username);
+		if (!qu) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		if (quota.max_user && qu->n >= quota.max_user) {
+			++quota.rejc_user;
+			err = EDQUOT;
+			goto out;
+		}
+	}
+
+	qi = ip_get(cli);
+	if (!qi) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (quota.max_ip && qi->n >= quota.max_ip) {
+		++quota.rejc_ip;
+		err = EDQUOT;
+		goto out;
+	}
+
+	++quota.total;
+	++qi->n;
+	if (qu)
+		++qu->n;
+
+ out:
+	if (err) {
+		qent_unused(qu, &quota.userc);
+		qent_unused(qi, &quota.ipc);
+	}
+
+	pthread_mutex_unlock(&quota.mutex);
+
+	return err;
+}
+
+
+void quota_release(const char *username, const struct sa *cli)
+{
+	pthread_mutex_lock(&quota.mutex);
+
+	if (quota.total)
+		--quota.total;
+
+	if (username)
+		qent_put(user_find(username), &quota.userc);
+
+	qent_put(ip_find(cli), &quota.ipc);
+
+	pthread_mutex_unlock(&quota.mutex);
+}
+
+
+void quota_status(struct mbuf *mb)
+{
+	pthread_mutex_lock(&quota.mutex);
+
+	(void)mbuf_printf(mb, "quota: total %u/%u users %u (max %u)"
+			  " ips %u (max %u) rejected %llu/%llu/%llu\n",
+			  quota.total, quota.max_total,
+			  quota.userc, quota.max_user,
+			  quota.ipc, quota.max_ip,
+			  quota.rejc_total, quota.rejc_user, quota.rejc_ip);
+
+	pthread_mutex_unlock(&quota.mutex);
+}
@@ -5,6 +5,7 @@
  */
 
 #include <string.h>
+#include <time.h>
 #include <re.h>
 #include <restund.h>
 #include "turn.h"
@@ -12,13 +13,10 @@
 
 enum {
 	ALLOC_DEFAULT_BSIZE = 512,
-};
-
-
-struct tuple {
-	const struct sa *cli_addr;
-	const struct sa *srv_addr;
-	int proto;
+	POOL_DEFAULT_SIZE   = 1024,
+	PORT_DEFAULT_MIN    = 49152,
+	PORT_DEFAULT_MAX    = 65535,
+	ULIMIT_HASH_SIZE    = 256,
 };
 
 
@@ -31,35 +29,84 @@ struct turnd *turndp(void)
 }
 
 
-static bool hash_cmp_handler(struct le *le, void *arg)
+struct turn_shard *turn_shard(void)
 {
-	const struct allocation *al = le->data;
-	const struct tuple *tup = arg;
+	return &turnd.shardv[restund_worker_index()];
+}
 
-	if (!sa_cmp(&al->cli_addr, tup->cli_addr, SA_ALL))
-		return false;
 
-	if (!sa_cmp(&al->srv_addr, tup->srv_addr, SA_ALL))
-		return false;
+struct portpool *turn_portpool(const struct sa *addr)
+{
+	return sa_af(addr) == AF_INET6 ? turnd.ports6 : turnd.ports;
+}
 
-	if (al->proto != tup->proto)
-		return false;
 
-	return true;
+static uint64_t time_us(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* log2 histogram, bucket i counts latencies below 2^(i+1) us */
+static void latency_add(struct turn_shard *sh, uint64_t us)
+{
+	uint32_t i = 0;
+
+	while (i < LAT_BUCKETS - 1 && us >> (i + 1))
+		++i;
+
+	++sh->latv[i];
+	sh->lat_max = (uint32_t)MIN(MAX(sh->lat_max, us), UINT32_MAX);
 }
 
 
-static struct allocation *allocation_find(int proto, const struct sa *src,
-					  const struct sa *dst)
+static uint32_t latency_pct(const uint64_t *latv, uint64_t n, uint32_t pct)
 {
-	struct tuple tup;
+	uint64_t c = 0;
+	uint32_t i;
 
-	tup.cli_addr = src;
-	tup.srv_addr = dst;
-	tup.proto = proto;
+	if (!n)
+		return 0;
 
-	return list_ledata(hash_lookup(turnd.ht_alloc, sa_hash(src, SA_ALL),
-				       hash_cmp_handler, &tup));
+	for (i=0; i<LAT_BUCKETS; i++) {
+
+		c += latv[i];
+
+		if (c * 100 >= n * pct)
+			break;
+	}
+
+	return 1u << MIN(i + 1, 31);
+}
+
+
+static inline struct allocation *allocation_find(int proto,
+						 const struct sa *src,
+						 const struct sa *dst)
+{
+	return atab_find(turn_shard()->atab, proto, src, dst);
+}
+
+
+static void key_update(struct allocation *al,
+		       const struct restund_msgctx *ctx,
+		       const struct stun_msg *msg)
+{
+	struct stun_attr *nonce = stun_msg_attr(msg, STUN_ATTR_NONCE);
+
+	if (!nonce)
+		return;
+
+	mem_deref(al->mi_key);
+	mem_deref(al->mi_nonce);
+
+	al->mi_key    = mem_ref(ctx->key);
+	al->mi_keylen = ctx->keylen;
+	al->mi_nonce  = mem_ref(nonce->v.nonce);
 }
 
 
@@ -69,6 +116,7 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 {
 	const uint16_t met = stun_msg_method(msg);
 	struct allocation *al;
+	uint64_t start;
 	int err = 0;
 
 	switch (met) {
@@ -117,10 +165,17 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 		}
 	}
 
+	/* authenticated with a new nonce, reuse the key from now on */
+	if (al && met != STUN_METHOD_ALLOCATE && ctx->key &&
+	    ctx->key != al->mi_key)
+		key_update(al, ctx, msg);
+
 	switch (met) {
 
 	case STUN_METHOD_ALLOCATE:
+		start = time_us();
 		allocate_request(&turnd, al, ctx, proto, sock, src, dst, msg);
+		latency_add(turn_shard(), time_us() - start);
 		break;
 
 	case STUN_METHOD_REFRESH:
@@ -145,6 +200,60 @@ static bool request_handler(struct restund_msgctx *ctx, int proto, void *sock,
 }
 
 
+/*
+ * Follow-up requests on an allocation are verified with the key the
+ * allocation was last authenticated with, one HMAC and no credential
+ * lookup. The auth module still checks the attributes and the nonce.
+ * The key is only reused with the nonce it was verified with, so the
+ * credentials are looked up again at least once per nonce lifetime. If
+ * a check fails the request takes the normal authentication path.
+ */
+static bool key_handler(struct restund_msgctx *ctx, int proto, void *sock,
+			const struct sa *src, const struct sa *dst,
+			const struct stun_msg *msg)
+{
+	struct stun_attr *usr, *nonce;
+	struct allocation *al;
+	(void)sock;
+
+	switch (stun_msg_method(msg)) {
+
+	case STUN_METHOD_REFRESH:
+	case STUN_METHOD_CREATEPERM:
+	case STUN_METHOD_CHANBIND:
+		break;
+
+	default:
+		return false;
+	}
+
+	if (ctx->key)
+		return false;
+
+	al = allocation_find(proto, src, dst);
+	if (!al || !al->mi_key || !al->username || !al->mi_nonce)
+		return false;
+
+	usr = stun_msg_attr(msg, STUN_ATTR_USERNAME);
+	if (!usr || strcmp(usr->v.username, al->username))
+		return false;
+
+	nonce = stun_msg_attr(msg, STUN_ATTR_NONCE);
+	if (!nonce || strcmp(nonce->v.nonce, al->mi_nonce))
+		return false;
+
+	if (!stun_msg_attr(msg, STUN_ATTR_MSG_INTEGRITY) ||
+	    stun_msg_chk_mi(msg, al->mi_key, al->mi_keylen))
+		return false;
+
+	ctx->key    = mem_ref(al->mi_key);
+	ctx->keylen = al->mi_keylen;
+	++al->shard->keyc;
+
+	return true;
+}
+
+
 static bool indication_handler(struct restund_msgctx *ctx, int proto,
 			       void *sock, const struct sa *src,
 			       const struct sa *dst,
@@ -179,22 +288,28 @@ static bool indication_handler(struct restund_msgctx *ctx, int proto,
 		return true;
 	}
 
+	if (!limit_check(al, mbuf_get_left(&data->v.data))) {
+		++al->dropc_tx;
+		return true;
+	}
+
 	err = udp_send(al->rel_us, &peer->v.xor_peer_addr, &data->v.data);
 	if (err)
-		turnd.errc_tx++;
+		al->shard->errc_tx++;
 	else {
 		const size_t bytes = mbuf_get_left(&data->v.data);
 
 		perm_tx_stat(perm, bytes);
-		turnd.bytec_tx += bytes;
+		al->shard->bytec_tx += bytes;
 	}
 
 	return true;
 }
 
 
-static bool raw_handler(int proto, const struct sa *src,
-			const struct sa *dst, struct mbuf *mb)
+/* ChannelData, classified by the first byte and not STUN decoded */
+static bool chan_handler(int proto, const struct sa *src,
+			 const struct sa *dst, struct mbuf *mb)
 {
 	struct allocation *al;
 	uint16_t numb, len;
@@ -230,32 +345,36 @@ static bool raw_handler(int proto, const struct sa *src,
 		return false;
 	}
 
+	if (!limit_check(al, mbuf_get_left(mb))) {
+		++al->dropc_tx;
+		return true;
+	}
+
 	err = udp_send(al->rel_us, chan_peer(chan), mb);
 	if (err)
-		turnd.errc_tx++;
+		al->shard->errc_tx++;
 	else {
 		const size_t bytes = mbuf_get_left(mb);
 
 		perm_tx_stat(perm, bytes);
-		turnd.bytec_tx += bytes;
+		al->shard->bytec_tx += bytes;
 	}
 
 	return true;
 }
 
 
-static bool allocation_status(struct le *le, void *arg)
+static bool allocation_status(struct allocation *al, void *arg)
 {
-	const uint32_t bsize = hash_bsize(turnd.ht_alloc);
-	struct allocation *al = le->data;
+	const uint32_t size = atab_size(al->shard->atab);
 	struct mbuf *mb = arg;
 
 	(void)mbuf_printf(mb,
 			  "- %04u %s/%J/%J - %J \"%s\" %us (drop %llu/%llu)\n",
-			  sa_hash(&al->cli_addr, SA_ALL) & (bsize - 1),
+			  al->hash & (size - 1),
 			  net_proto2name(al->proto), &al->cli_addr,
 			  &al->srv_addr, &al->rel_addr, al->username,
-			  (uint32_t)tmr_get_expire(&al->tmr) / 1000,
+			  (uint32_t)wtmr_get_expire(&al->tmr) / 1000,
 			  al->dropc_tx, al->dropc_rx);
 
 	perm_status(al->perms, mb);
@@ -265,31 +384,154 @@ static bool allocation_status(struct le *le, void *arg)
 }
 
 
+/* runs on the event loop owning the shard */
+static void shard_status(void *arg)
+{
+	atab_status(turn_shard()->atab, arg);
+	atab_apply(turn_shard()->atab, allocation_status, arg);
+}
+
+
+/*
+ * Shard counters are only written by the owning worker, so they are
+ * summed on that worker. restund_worker_call() runs one shard at a time
+ * and waits for it.
+ */
+struct shard_sum {
+	struct turn_shard sum;
+	uint64_t latc;
+	uint32_t warmc;
+};
+
+
+static void shard_sum(void *arg)
+{
+	struct shard_sum *ss = arg;
+	struct turn_shard *sum = &ss->sum;
+	const struct turn_shard *sh = turn_shard();
+	uint32_t j;
+
+	sum->allocc_cur    += sh->allocc_cur;
+	sum->allocc_tot    += sh->allocc_tot;
+	sum->bytec_tx      += sh->bytec_tx;
+	sum->bytec_rx      += sh->bytec_rx;
+	sum->errc_tx       += sh->errc_tx;
+	sum->errc_rx       += sh->errc_rx;
+	sum->chan_cur      += sh->chan_cur;
+	sum->batch.rxc     += sh->batch.rxc;
+	sum->batch.rx_pktc += sh->batch.rx_pktc;
+	sum->batch.rx_max   = MAX(sum->batch.rx_max, sh->batch.rx_max);
+	sum->batch.txc     += sh->batch.txc;
+	sum->batch.tx_pktc += sh->batch.tx_pktc;
+	sum->batch.tx_max   = MAX(sum->batch.tx_max, sh->batch.tx_max);
+	sum->batch.tx_errc += sh->batch.tx_errc;
+	sum->lat_max        = MAX(sum->lat_max, sh->lat_max);
+	sum->keyc          += sh->keyc;
+	ss->warmc          += warm_count(sh);
+
+	for (j=0; j<LAT_BUCKETS; j++) {
+		sum->latv[j] += sh->latv[j];
+		ss->latc     += sh->latv[j];
+	}
+}
+
+
+static void shards_sum(struct shard_sum *ss)
+{
+	uint32_t i;
+
+	memset(ss, 0, sizeof(*ss));
+
+	for (i=0; i<turnd.shardc; i++)
+		(void)restund_worker_call(i, shard_sum, ss);
+}
+
+
 static void status_handler(struct mbuf *mb)
 {
+	struct shard_sum ss;
+	uint32_t i;
+
+	shards_sum(&ss);
+
 	(void)mbuf_printf(mb, "TURN relay=%j relay6=%j (err %llu/%llu)\n",
 			  &turnd.rel_addr, &turnd.rel_addr6,
-			  turnd.errc_tx, turnd.errc_rx);
-	(void)hash_apply(turnd.ht_alloc, allocation_status, mb);
+			  ss.sum.errc_tx, ss.sum.errc_rx);
+
+	quota_status(mb);
+
+	for (i=0; i<turnd.shardc; i++)
+		(void)restund_worker_call(i, shard_status, mb);
 }
 
 
 static void stats_handler(struct mbuf *mb)
 {
-	(void)mbuf_printf(mb, "allocs_cur %u\n", turnd.allocc_cur);
-	(void)mbuf_printf(mb, "allocs_tot %llu\n", turnd.allocc_tot);
-	(void)mbuf_printf(mb, "bytes_tx %llu\n", turnd.bytec_tx);
-	(void)mbuf_printf(mb, "bytes_rx %llu\n", turnd.bytec_rx);
+	uint32_t ports_free = 0, ports_used = 0;
+	struct shard_sum ss;
+	const struct turn_shard *sum = &ss.sum;
+
+	portpool_stat(turnd.ports,  &ports_free, &ports_used);
+	portpool_stat(turnd.ports6, &ports_free, &ports_used);
+
+	shards_sum(&ss);
+
+	(void)mbuf_printf(mb, "allocs_cur %u\n", sum->allocc_cur);
+	(void)mbuf_printf(mb, "allocs_tot %llu\n", sum->allocc_tot);
+	(void)mbuf_printf(mb, "bytes_tx %llu\n", sum->bytec_tx);
+	(void)mbuf_printf(mb, "bytes_rx %llu\n", sum->bytec_rx);
 	(void)mbuf_printf(mb, "bytes_tot %llu\n",
-			  turnd.bytec_tx + turnd.bytec_rx);
-	(void)mbuf_printf(mb, "chan_cur %llu\n", turnd.chan_cur);
+			  sum->bytec_tx + sum->bytec_rx);
+	(void)mbuf_printf(mb, "chan_cur %u\n", sum->chan_cur);
+	(void)mbuf_printf(mb, "batch_rx_calls %llu\n", sum->batch.rxc);
+	(void)mbuf_printf(mb, "batch_rx_pkts %llu\n", sum->batch.rx_pktc);
+	(void)mbuf_printf(mb, "batch_rx_max %u\n", sum->batch.rx_max);
+	(void)mbuf_printf(mb, "batch_tx_calls %llu\n", sum->batch.txc);
+	(void)mbuf_printf(mb, "batch_tx_pkts %llu\n", sum->batch.tx_pktc);
+	(void)mbuf_printf(mb, "batch_tx_max %u\n", sum->batch.tx_max);
+	(void)mbuf_printf(mb, "batch_tx_err %llu\n", sum->batch.tx_errc);
+	(void)mbuf_printf(mb, "workers %u\n", turnd.shardc);
+	(void)mbuf_printf(mb, "ports_free %u\n", ports_free);
+	(void)mbuf_printf(mb, "ports_used %u\n", ports_used);
+	(void)mbuf_printf(mb, "alloc_lat_p50_us %u\n",
+			  latency_pct(sum->latv, ss.latc, 50));
+	(void)mbuf_printf(mb, "alloc_lat_p90_us %u\n",
+			  latency_pct(sum->latv, ss.latc, 90));
+	(void)mbuf_printf(mb, "alloc_lat_p99_us %u\n",
+			  latency_pct(sum->latv, ss.latc, 99));
+	(void)mbuf_printf(mb, "alloc_lat_max_us %u\n", sum->lat_max);
+	(void)mbuf_printf(mb, "warm_socks %u\n", ss.warmc);
+	(void)mbuf_printf(mb, "key_reuse %llu\n", sum->keyc);
+}
+
+
+/* runs on the event loop owning the shard */
+static void shard_pools(void *arg)
+{
+	const struct turn_shard *sh = turn_shard();
+
+	pool_status(&sh->pool_alloc, arg);
+	pool_status(&sh->pool_perm, arg);
+	pool_status(&sh->pool_chan, arg);
+}
+
+
+static void pools_handler(struct mbuf *mb)
+{
+	uint32_t i;
+
+	for (i=0; i<turnd.shardc; i++) {
+		(void)mbuf_printf(mb, "shard %u:\n", i);
+		(void)restund_worker_call(i, shard_pools, mb);
+	}
 }
 
 
 static struct restund_stun stun = {
-	.reqh = request_handler,
-	.indh = indication_handler,
-	.rawh = raw_handler,
+	.reqh  = request_handler,
+	.indh  = indication_handler,
+	.chanh = chan_handler,
+	.keyh  = key_handler,
 };
 
 
@@ -305,15 +547,23 @@ static struct restund_cmdsub cmd_turnstats = {
 };
 
 
+static struct restund_cmdsub cmd_pools = {
+	.cmdh = pools_handler,
+	.cmd  = "pools",
+};
+
+
 static int module_init(void)
 {
-	uint32_t x, bsize = ALLOC_DEFAULT_BSIZE;
+	uint32_t i, x, bsize = ALLOC_DEFAULT_BSIZE;
+	uint32_t port_min = 0, port_max = 0;
 	struct pl opt;
 	int err = 0;
 
 	restund_stun_register_handler(&stun);
 	restund_cmd_subscribe(&cmd_turn);
 	restund_cmd_subscribe(&cmd_turnstats);
+	restund_cmd_subscribe(&cmd_pools);
 
 	/* turn_external_addr */
 	if (!conf_get(restund_conf(), "turn_relay_addr", &opt))
@@ -350,29 +600,134 @@ static int module_init(void)
 	conf_get_u32(restund_conf(), "turn_max_allocations", &bsize);
 	conf_get_u32(restund_conf(), "udp_sockbuf_size",
 		     &turnd.udp_sockbuf_size);
+	turnd.pool_size = POOL_DEFAULT_SIZE;
+	conf_get_u32(restund_conf(), "turn_pool_size", &turnd.pool_size);
+	conf_get_u32(restund_conf(), "turn_warm_sockets", &turnd.warm_size);
+
+	/* rate limits, 0 is unlimited */
+	conf_get_u32(restund_conf(), "turn_alloc_bps", &turnd.lim_alloc.bps);
+	conf_get_u32(restund_conf(), "turn_alloc_pps", &turnd.lim_alloc.pps);
+	conf_get_u32(restund_conf(), "turn_user_bps", &turnd.lim_user.bps);
+	conf_get_u32(restund_conf(), "turn_user_pps", &turnd.lim_user.pps);
+
+	err = quota_init();
+	if (err) {
+		restund_error("turn: quota init: %m\n", err);
+		goto out;
+	}
+
+	/* turn_port_min, turn_port_max, kernel chosen ports if unset */
+	conf_get_u32(restund_conf(), "turn_port_min", &port_min);
+	conf_get_u32(restund_conf(), "turn_port_max", &port_max);
+
+	if (port_min || port_max) {
+
+		if (!port_min)
+			port_min = PORT_DEFAULT_MIN;
+		if (!port_max)
+			port_max = PORT_DEFAULT_MAX;
+
+		if (port_min > port_max || port_max > 65535) {
+			restund_error("turn: bad relay port range %u-%u\n",
+				      port_min, port_max);
+			err = EINVAL;
+			goto out;
+		}
+
+		if (sa_isset(&turnd.rel_addr, SA_ADDR))
+			err = portpool_alloc(&turnd.ports, port_min,
+					     port_max);
+		if (!err && sa_isset(&turnd.rel_addr6, SA_ADDR))
+			err = portpool_alloc(&turnd.ports6, port_min,
+					     port_max);
+		if (err) {
+			restund_error("turn: port pool alloc error: %m\n",
+				      err);
+			goto out;
+		}
+	}
 
 	for (x=2; (uint32_t)1<<x<bsize; x++);
 	bsize = 1<<x;
 
-	err = hash_alloc(&turnd.ht_alloc, bsize);
-	if (err) {
-		restund_error("turnd hash alloc error: %m\n", err);
+	/* one shard per event loop */
+	turnd.shardc = restund_worker_count();
+	turnd.shardv = mem_zalloc(turnd.shardc * sizeof(*turnd.shardv), NULL);
+	if (!turnd.shardv) {
+		err = ENOMEM;
 		goto out;
 	}
 
-	restund_debug("turn: lifetime=%u ext=%j ext6=%j bsz=%u\n",
+	for (i=0; i<turnd.shardc; i++) {
+
+		struct turn_shard *sh = &turnd.shardv[i];
+
+		wheel_init(&sh->wheel);
+		pool_init(&sh->pool_alloc, "alloc", turnd.pool_size);
+		pool_init(&sh->pool_perm,  "perm",  turnd.pool_size);
+		pool_init(&sh->pool_chan,  "chan",  turnd.pool_size);
+		warm_init(sh);
+
+		err = atab_alloc(&sh->atab, bsize);
+		if (err) {
+			restund_error("turnd alloc table error: %m\n", err);
+			goto out;
+		}
+
+		err = hash_alloc(&sh->ht_ulimit, ULIMIT_HASH_SIZE);
+		if (err)
+			goto out;
+	}
+
+	/* workers fill their pools on the first Allocate */
+	warm_start(&turnd.shardv[0]);
+
+	restund_debug("turn: lifetime=%u ext=%j ext6=%j bsz=%u shards=%u"
+		      " ports=%u-%u warm=%u\n",
 		      turnd.lifetime_max, &turnd.rel_addr, &turnd.rel_addr6,
-		      bsize);
+		      bsize, turnd.shardc, port_min, port_max, turnd.warm_size);
 
  out:
 	return err;
 }
 
 
+/* runs on the event loop owning the shard */
+static void shard_flush(void *arg)
+{
+	struct turn_shard *sh = turn_shard();
+	(void)arg;
+
+	atab_flush(sh->atab);
+	warm_flush(sh);
+	wheel_close(&sh->wheel);
+	pool_flush(&sh->pool_alloc);
+	pool_flush(&sh->pool_perm);
+	pool_flush(&sh->pool_chan);
+}
+
+
 static int module_close(void)
 {
-	hash_flush(turnd.ht_alloc);
-	turnd.ht_alloc = mem_deref(turnd.ht_alloc);
+	uint32_t i;
+
+	for (i=0; i<turnd.shardc; i++) {
+
+		if (!turnd.shardv[i].atab)
+			continue;
+
+		(void)restund_worker_call(i, shard_flush, NULL);
+		turnd.shardv[i].atab = mem_deref(turnd.shardv[i].atab);
+		turnd.shardv[i].ht_ulimit =
+			mem_deref(turnd.shardv[i].ht_ulimit);
+	}
+
+	turnd.shardv = mem_deref(turnd.shardv);
+	turnd.shardc = 0;
+	turnd.ports  = mem_deref(turnd.ports);
+	turnd.ports6 = mem_deref(turnd.ports6);
+	quota_close();
+	restund_cmd_unsubscribe(&cmd_pools);
 	restund_cmd_unsubscribe(&cmd_turnstats);
 	restund_cmd_unsubscribe(&cmd_turn);
 	restund_stun_unregister_handler(&stun);
@@ -4,26 +4,166 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
-struct turnd {
-	struct sa rel_addr;
-	struct sa rel_addr6;
-	struct hash *ht_alloc;
+enum {
+	WHEEL_TICK   = 100,  /* ms */
+	WHEEL_BITS   = 6,
+	WHEEL_SLOTS  = 1 << WHEEL_BITS,
+	WHEEL_LEVELS = 4,
+};
+
+typedef void (wtmr_h)(void *arg);
+
+struct wheel;
+
+/* wheel timer, le must be the first member */
+struct wtmr {
+	struct le le;
+	uint64_t expires;
+	wtmr_h *th;
+	struct wheel *w;
+};
+
+struct wheel {
+	struct list slotv[WHEEL_LEVELS][WHEEL_SLOTS];
+	struct tmr tmr;
+	uint64_t tick;
+	uint64_t jfs;
+	uint32_t count;
+	bool active;
+};
+
+void wheel_init(struct wheel *w);
+void wheel_close(struct wheel *w);
+void wtmr_start(struct wheel *w, struct wtmr *t, uint64_t delay,
+		wtmr_h *th, void *arg);
+void wtmr_cancel(struct wtmr *t);
+uint64_t wtmr_get_expire(const struct wtmr *t);
+
+
+enum port_type {
+	PORT_ANY = 0,
+	PORT_EVEN,
+	PORT_PAIR,
+	PORT_TYPES
+};
+
+enum {
+	PORT_TRY_MAX = 32,
+};
+
+struct portpool;
+
+int  portpool_alloc(struct portpool **ppp, uint16_t min, uint16_t max);
+int  portpool_get(struct portpool *pp, enum port_type type, uint16_t *port);
+void portpool_put(struct portpool *pp, uint16_t port);
+void portpool_stat(struct portpool *pp, uint32_t *freec, uint32_t *usedc);
+int  portpool_listen(struct portpool *pp, enum port_type type,
+		     const struct sa *rel_addr, struct sa *laddr,
+		     struct udp_sock **usp, struct udp_sock **rsvp,
+		     udp_recv_h *rh, void *arg);
+
+
+struct pool {
+	struct list freel;
+	const char *name;
+	size_t size;
+	uint32_t max;
+	uint32_t used;
+	uint32_t freec;
+	uint32_t hiwat;
+	uint64_t allocc;
+	uint64_t reusec;
+};
+
+void pool_init(struct pool *p, const char *name, uint32_t max);
+void *pool_get(struct pool *p, size_t size, mem_destroy_h *dh);
+void pool_put(struct pool *p, void *obj, struct le *le);
+void pool_flush(struct pool *p);
+void pool_status(const struct pool *p, struct mbuf *mb);
+
+
+enum {
+	LAT_BUCKETS = 24,
+};
+
+/* pre-bound relay sockets of one address family */
+struct warm {
+	struct list sockl;
+	uint32_t count;
+};
+
+/* token bucket with one second of burst, a rate of 0 is unlimited */
+struct tbucket {
+	uint64_t tokens;  /* 1/1000 units */
+	uint64_t ts;
+	uint32_t rate;
+};
+
+struct limiter {
+	struct tbucket bytes;
+	struct tbucket pkts;
+};
+
+void limiter_init(struct limiter *lim, const struct restund_limits *rl);
+
+/* per event loop state, only touched by the owning worker */
+struct turn_shard {
+	struct atab *atab;
 	uint64_t bytec_tx;
 	uint64_t bytec_rx;
 	uint64_t errc_tx;
 	uint64_t errc_rx;
 	uint64_t allocc_tot;
 	uint32_t allocc_cur;
+	uint32_t chan_cur;
+	struct restund_batchstat batch;
+	struct wheel wheel;
+	struct pool pool_alloc;
+	struct pool pool_perm;
+	struct pool pool_chan;
+	struct warm warmv[2];
+	struct tmr warm_tmr;
+	uint64_t latv[LAT_BUCKETS];
+	uint32_t lat_max;
+	struct hash *ht_ulimit;
+	uint64_t keyc;
+};
+
+struct turnd {
+	struct sa rel_addr;
+	struct sa rel_addr6;
+	struct portpool *ports;
+	struct portpool *ports6;
+	struct turn_shard *shardv;
+	uint32_t shardc;
 	uint32_t lifetime_max;
 	uint32_t udp_sockbuf_size;
-    uint32_t chan_cur;
+	uint32_t pool_size;
+	uint32_t warm_size;
+	struct restund_limits lim_alloc;
+	struct restund_limits lim_user;
 };
 
 struct chanlist;
+struct atab;
+struct ulimit;
+
+/* packed 5-tuple of an allocation */
+struct atab_key {
+	uint16_t cport;
+	uint16_t sport;
+	uint8_t proto;
+	uint8_t af;
+	uint8_t pad[2];
+	uint8_t caddr[16];
+	uint8_t saddr[16];
+};
 
 struct allocation {
-	struct le he;
-	struct tmr tmr;
+	struct le ple;
+	struct atab_key key;
+	uint32_t hash;
+	struct wtmr tmr;
 	uint8_t tid[STUN_TID_SIZE];
 	struct sa cli_addr;
 	struct sa srv_addr;
@@ -32,12 +172,22 @@ struct allocation {
 	void *cli_sock;
 	struct udp_sock *rel_us;
 	struct udp_sock *rsv_us;
+	struct restund_udp_batch *rel_ub;
+	struct turn_shard *shard;
 	char *username;
+	uint8_t *mi_key;
+	uint32_t mi_keylen;
+	char *mi_nonce;
 	struct hash *perms;
 	struct chanlist *chans;
 	uint64_t dropc_tx;
 	uint64_t dropc_rx;
+	struct limiter lim;
+	struct ulimit *ul;
 	int proto;
+	bool gather;
+	bool limited;
+	bool quota;
 };
 
 void allocate_request(struct turnd *turnd, struct allocation *alx,
@@ -54,7 +204,28 @@ void createperm_request(struct allocation *al, struct restund_msgctx *ctx,
 void chanbind_request(struct allocation *al, struct restund_msgctx *ctx,
 		      int proto, void *sock, const struct sa *src,
 		      const struct stun_msg *msg);
+void allocation_release(struct allocation *al);
 struct turnd *turndp(void);
+struct turn_shard *turn_shard(void);
+struct portpool *turn_portpool(const struct sa *addr);
+void relay_sock_setup(struct udp_sock *us);
+
+
+typedef bool (atab_cmp_h)(const struct allocation *al, void *arg);
+typedef bool (atab_apply_h)(struct allocation *al, void *arg);
+
+int  atab_alloc(struct atab **tp, uint32_t size);
+int  atab_insert(struct atab *t, struct allocation *al, int proto,
+		 const struct sa *cli, const struct sa *srv);
+void atab_remove(struct atab *t, struct allocation *al);
+struct allocation *atab_find(struct atab *t, int proto, const struct sa *cli,
+			     const struct sa *srv);
+struct allocation *atab_lookup(struct atab *t, uint32_t hash,
+			       atab_cmp_h *cmph, void *arg);
+void atab_apply(struct atab *t, atab_apply_h *h, void *arg);
+void atab_flush(struct atab *t);
+uint32_t atab_size(const struct atab *t);
+void atab_status(const struct atab *t, struct mbuf *mb);
 
 
 struct perm;
@@ -62,6 +233,8 @@ struct perm;
 struct perm *perm_find(const struct hash *ht, const struct sa *addr);
 struct perm *perm_create(struct hash *ht, const struct sa *peer,
 			 const struct allocation *al);
+void perm_release(struct perm *perm);
+void perm_flush(struct hash *ht);
 void perm_refresh(struct perm *perm);
 void perm_tx_stat(struct perm *perm, size_t bytc);
 void perm_rx_stat(struct perm *perm, size_t bytc);
@@ -76,4 +249,25 @@ struct chan *chan_peer_find(const struct chanlist *cl, const struct sa *peer);
 uint16_t chan_numb(const struct chan *chan);
 const struct sa *chan_peer(const struct chan *chan);
 int  chanlist_alloc(struct chanlist **clp, uint32_t bsize);
+void chanlist_flush(struct chanlist *cl);
 void chan_status(const struct chanlist *cl, struct mbuf *mb);
+
+
+void warm_init(struct turn_shard *sh);
+void warm_start(struct turn_shard *sh);
+void warm_flush(struct turn_shard *sh);
+int  warm_take(struct turn_shard *sh, const struct sa *rel_addr, bool even,
+	       struct udp_sock **usp, struct sa *addr);
+uint32_t warm_count(const struct turn_shard *sh);
+
+
+void limit_attach(struct allocation *al);
+void limit_detach(struct allocation *al);
+bool limit_check(struct allocation *al, size_t bytes);
+
+
+int  quota_init(void);
+void quota_close(void);
+int  quota_acquire(const char *username, const struct sa *cli);
+void quota_release(const char *username, const struct sa *cli);
+void quota_status(struct mbuf *mb);
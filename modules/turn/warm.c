@@ -0,0 +1,197 @@
+/**
+ * @file warm.c Turn Server Warm Relay Sockets
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <re.h>
+#include <restund.h>
+#include "turn.h"
+
+
+/*
+ * Each shard keeps a few relay sockets per relay address bound and
+ * configured ahead of time, so an Allocate only has to take one. The
+ * pool is refilled from a timer, a few sockets at a time, after the
+ * Allocate has been answered.
+ */
+
+
+enum {
+	WARM_INTERVAL = 10,  /* ms */
+	WARM_BATCH    = 4,
+};
+
+
+struct wsock {
+	struct le le;
+	struct sa addr;
+	struct udp_sock *us;
+};
+
+
+static void wsock_destructor(void *arg)
+{
+	struct wsock *ws = arg;
+
+	list_unlink(&ws->le);
+
+	if (ws->us) {
+		mem_deref(ws->us);
+		portpool_put(turn_portpool(&ws->addr), sa_port(&ws->addr));
+	}
+}
+
+
+static const struct sa *warm_addr(unsigned i)
+{
+	return i == 0 ? &turndp()->rel_addr : &turndp()->rel_addr6;
+}
+
+
+/* packets reaching a socket before it is taken are dropped */
+static void wsock_recv(const struct sa *src, struct mbuf *mb, void *arg)
+{
+	(void)src;
+	(void)mb;
+	(void)arg;
+}
+
+
+static int wsock_alloc(struct warm *wm, const struct sa *rel_addr)
+{
+	struct wsock *ws;
+	int err;
+
+	ws = mem_zalloc(sizeof(*ws), wsock_destructor);
+	if (!ws)
+		return ENOMEM;
+
+	err = portpool_listen(turn_portpool(rel_addr), PORT_ANY, rel_addr,
+			      &ws->addr, &ws->us, NULL, wsock_recv, NULL);
+	if (err) {
+		mem_deref(ws);
+		return err;
+	}
+
+	relay_sock_setup(ws->us);
+
+	list_append(&wm->sockl, &ws->le, ws);
+	++wm->count;
+
+	return 0;
+}
+
+
+static void refill(void *arg)
+{
+	struct turn_shard *sh = arg;
+	bool more = false;
+	unsigned i;
+
+	for (i=0; i<2; i++) {
+
+		struct warm *wm = &sh->warmv[i];
+		uint32_t n;
+		int err = 0;
+
+		if (!sa_isset(warm_addr(i), SA_ADDR))
+			continue;
+
+		for (n=0; n<WARM_BATCH; n++) {
+
+			if (wm->count >= turndp()->warm_size)
+				break;
+
+			err = wsock_alloc(wm, warm_addr(i));
+			if (err)
+				break;
+		}
+
+		/* on error (e.g. out of ports) wait for the next take */
+		if (!err && wm->count < turndp()->warm_size)
+			more = true;
+	}
+
+	if (more)
+		tmr_start(&sh->warm_tmr, WARM_INTERVAL, refill, sh);
+}
+
+
+void warm_init(struct turn_shard *sh)
+{
+	unsigned i;
+
+	for (i=0; i<2; i++) {
+		list_init(&sh->warmv[i].sockl);
+		sh->warmv[i].count = 0;
+	}
+
+	tmr_init(&sh->warm_tmr);
+}
+
+
+/* start filling the pool, must run on the event loop owning the shard */
+void warm_start(struct turn_shard *sh)
+{
+	const struct turnd *turnd = turndp();
+
+	if (!turnd->warm_size || tmr_isrunning(&sh->warm_tmr))
+		return;
+
+	tmr_start(&sh->warm_tmr, 0, refill, sh);
+}
+
+
+void warm_flush(struct turn_shard *sh)
+{
+	unsigned i;
+
+	tmr_cancel(&sh->warm_tmr);
+
+	for (i=0; i<2; i++) {
+		list_flush(&sh->warmv[i].sockl);
+		sh->warmv[i].count = 0;
+	}
+}
+
+
+/* take a warm socket, the receive handler is set by the caller */
+int warm_take(struct turn_shard *sh, const struct sa *rel_addr, bool even,
+	      struct udp_sock **usp, struct sa *addr)
+{
+	struct warm *wm;
+	struct le *le;
+
+	if (!turndp()->warm_size)
+		return ENOENT;
+
+	wm = &sh->warmv[sa_af(rel_addr) == AF_INET6 ? 1 : 0];
+
+	warm_start(sh);
+
+	for (le = wm->sockl.head; le; le = le->next) {
+
+		struct wsock *ws = le->data;
+
+		if (even && (sa_port(&ws->addr) & 0x1))
+			continue;
+
+		*usp  = ws->us;
+		*addr = ws->addr;
+
+		ws->us = NULL;
+		--wm->count;
+		mem_deref(ws);
+
+		return 0;
+	}
+
+	return ENOENT;
+}
+
+
+uint32_t warm_count(const struct turn_shard *sh)
+{
+	return sh->warmv[0].count + sh->warmv[1].count;
+}
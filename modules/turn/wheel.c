@@ -0,0 +1,192 @@
+/**
+ * @file wheel.c Turn Server Timing Wheel
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <re.h>
+#include <restund.h>
+#include "turn.h"
+
+
+/*
+ * Hierarchical timing wheel for allocation, permission and channel
+ * lifetimes. Each level has WHEEL_SLOTS slots, level 0 advances one slot
+ * per tick and every higher level covers WHEEL_SLOTS times the range of
+ * the level below. Starting, refreshing and cancelling a timer is O(1).
+ * Entries in a higher level are cascaded down when level 0 wraps.
+ *
+ * The wheel is driven by one libre timer per shard, which only runs
+ * while timers are pending. The tick count doubles as a coarse clock,
+ * so no time lookups are needed when forwarding packets.
+ */
+
+
+enum {
+	WHEEL_MASK  = WHEEL_SLOTS - 1,
+	WHEEL_RANGE = 1 << (WHEEL_LEVELS * WHEEL_BITS),
+};
+
+
+static inline uint32_t slot_index(uint64_t expires, unsigned level)
+{
+	return (uint32_t)(expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+}
+
+
+static void place(struct wheel *w, struct wtmr *t)
+{
+	const uint64_t delta = t->expires - w->tick;
+	unsigned level;
+
+	for (level=0; level<WHEEL_LEVELS-1; level++) {
+
+		if (delta < (uint64_t)1 << ((level + 1) * WHEEL_BITS))
+			break;
+	}
+
+	list_append(&w->slotv[level][slot_index(t->expires, level)],
+		    &t->le, t->le.data);
+}
+
+
+static void cascade(struct wheel *w, unsigned level)
+{
+	struct list *slot = &w->slotv[level][slot_index(w->tick, level)];
+	struct le *le;
+
+	while ((le = list_head(slot))) {
+
+		list_unlink(le);
+		place(w, (struct wtmr *)le);
+	}
+}
+
+
+static void advance(struct wheel *w)
+{
+	struct list *slot;
+	struct le *le;
+	unsigned level;
+
+	++w->tick;
+
+	for (level=1; level<WHEEL_LEVELS; level++) {
+
+		if (slot_index(w->tick, level - 1))
+			break;
+
+		cascade(w, level);
+	}
+
+	slot = &w->slotv[0][slot_index(w->tick, 0)];
+
+	/* the handler may cancel other timers in this slot */
+	while ((le = list_head(slot))) {
+
+		struct wtmr *t = (struct wtmr *)le;
+
+		list_unlink(le);
+		t->w = NULL;
+		--w->count;
+
+		t->th(le->data);
+	}
+}
+
+
+static void tick_handler(void *arg)
+{
+	struct wheel *w = arg;
+	const uint64_t now = tmr_jiffies();
+
+	while (now - w->jfs >= WHEEL_TICK) {
+
+		w->jfs += WHEEL_TICK;
+		advance(w);
+	}
+
+	if (w->count)
+		tmr_start(&w->tmr, WHEEL_TICK - (now - w->jfs),
+			  tick_handler, w);
+	else
+		w->active = false;
+}
+
+
+void wheel_init(struct wheel *w)
+{
+	unsigned i, j;
+
+	if (!w)
+		return;
+
+	for (i=0; i<WHEEL_LEVELS; i++)
+		for (j=0; j<WHEEL_SLOTS; j++)
+			list_init(&w->slotv[i][j]);
+
+	tmr_init(&w->tmr);
+	w->tick   = 0;
+	w->jfs    = 0;
+	w->count  = 0;
+	w->active = false;
+}
+
+
+void wheel_close(struct wheel *w)
+{
+	if (!w)
+		return;
+
+	tmr_cancel(&w->tmr);
+	w->active = false;
+}
+
+
+/* start or restart a timer, must run on the event loop owning the wheel */
+void wtmr_start(struct wheel *w, struct wtmr *t, uint64_t delay,
+		wtmr_h *th, void *arg)
+{
+	if (!w || !t)
+		return;
+
+	wtmr_cancel(t);
+
+	if (!w->active) {
+		w->active = true;
+		w->jfs    = tmr_jiffies();
+		tmr_start(&w->tmr, WHEEL_TICK, tick_handler, w);
+	}
+
+	delay = (delay + WHEEL_TICK - 1) / WHEEL_TICK;
+	delay = MIN(MAX(delay, 1), WHEEL_RANGE - 1);
+
+	t->expires = w->tick + delay;
+	t->th      = th;
+	t->w       = w;
+	t->le.data = arg;
+
+	place(w, t);
+	++w->count;
+}
+
+
+void wtmr_cancel(struct wtmr *t)
+{
+	if (!t || !t->w)
+		return;
+
+	list_unlink(&t->le);
+	--t->w->count;
+	t->w = NULL;
+}
+
+
+/* remaining time in milliseconds */
+uint64_t wtmr_get_expire(const struct wtmr *t)
+{
+	if (!t || !t->w || t->expires <= t->w->tick)
+		return 0;
+
+	return (t->expires - t->w->tick) * WHEEL_TICK;
+}
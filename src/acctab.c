@@ -0,0 +1,234 @@
+/**
+ * @file acctab.c Packed Account Table
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * The account table of a full sync is built once and never changed.
+ * All records are packed into one arena; a record is the HA1, the
+ * username length (16 bits, host order) and the username. The index is
+ * an open addressed table of username hash and record offset with a load
+ * factor of at most 3/4, so a lookup touches one index slot and one
+ * record in the common case.
+ */
+
+
+enum {
+	REC_HDR  = MD5_SIZE + 2,
+	REC_AVG  = REC_HDR + 16,
+};
+
+
+struct slot {
+	uint32_t hash;
+	uint32_t off;   /* record offset + 1, 0 if empty */
+};
+
+
+struct restund_acctab {
+	uint8_t *arena;
+	size_t size;
+	size_t end;
+	struct slot *slotv;
+	uint32_t mask;
+	uint32_t n;
+	uint32_t dupc;
+};
+
+
+static void destructor(void *arg)
+{
+	struct restund_acctab *t = arg;
+
+	mem_deref(t->slotv);
+	mem_deref(t->arena);
+}
+
+
+static inline uint16_t rec_len(const uint8_t *rec)
+{
+	uint16_t len;
+
+	memcpy(&len, rec + MD5_SIZE, sizeof(len));
+
+	return len;
+}
+
+
+int restund_acctab_alloc(struct restund_acctab **tp, uint32_t hint)
+{
+	struct restund_acctab *t;
+
+	if (!tp)
+		return EINVAL;
+
+	t = mem_zalloc(sizeof(*t), destructor);
+	if (!t)
+		return ENOMEM;
+
+	t->size  = (size_t)MAX(hint, 64) * REC_AVG;
+	t->arena = mem_alloc(t->size, NULL);
+	if (!t->arena) {
+		mem_deref(t);
+		return ENOMEM;
+	}
+
+	*tp = t;
+
+	return 0;
+}
+
+
+int restund_acctab_add(struct restund_acctab *t, const char *username,
+		       const uint8_t *ha1)
+{
+	uint16_t len16;
+	uint8_t *rec;
+	size_t len;
+
+	if (!t || !username || !ha1 || t->slotv)
+		return EINVAL;
+
+	len = strlen(username);
+	if (len > 0xffff)
+		return EINVAL;
+
+	if (t->end + REC_HDR + len > t->size) {
+
+		size_t sz = MAX(2 * t->size, t->end + REC_HDR + len);
+		uint8_t *arena;
+
+		/* offsets are 32 bits */
+		if (sz >= 0xffffffffu)
+			return EOVERFLOW;
+
+		arena = mem_realloc(t->arena, sz);
+		if (!arena)
+			return ENOMEM;
+
+		t->arena = arena;
+		t->size  = sz;
+	}
+
+	len16 = (uint16_t)len;
+	rec = t->arena + t->end;
+
+	memcpy(rec, ha1, MD5_SIZE);
+	memcpy(rec + MD5_SIZE, &len16, sizeof(len16));
+	memcpy(rec + REC_HDR, username, len);
+
+	t->end += REC_HDR + len;
+	++t->n;
+
+	return 0;
+}
+
+
+static const uint8_t *slot_find(const struct restund_acctab *t, uint32_t h,
+				const char *username, size_t len, uint32_t *ip)
+{
+	uint32_t i;
+
+	for (i = h & t->mask; t->slotv[i].off; i = (i + 1) & t->mask) {
+
+		const struct slot *s = &t->slotv[i];
+		const uint8_t *rec = t->arena + s->off - 1;
+
+		if (s->hash == h && rec_len(rec) == len &&
+		    !memcmp(rec + REC_HDR, username, len))
+			return rec;
+	}
+
+	if (ip)
+		*ip = i;
+
+	return NULL;
+}
+
+
+/* index all records; the table is read-only afterwards */
+int restund_acctab_build(struct restund_acctab *t)
+{
+	uint32_t sz = 4;
+	size_t off;
+
+	if (!t || t->slotv)
+		return EINVAL;
+
+	while (sz < t->n + t->n / 3 + 1)
+		sz <<= 1;
+
+	t->slotv = mem_zalloc(sz * sizeof(*t->slotv), NULL);
+	if (!t->slotv)
+		return ENOMEM;
+
+	t->mask = sz - 1;
+
+	for (off = 0; off < t->end; off += REC_HDR + rec_len(t->arena + off)) {
+
+		const uint8_t *rec = t->arena + off;
+		const char *name = (const char *)rec + REC_HDR;
+		const uint16_t len = rec_len(rec);
+		const uint32_t h = hash_joaat((const uint8_t *)name, len);
+		uint32_t i;
+
+		/* the first record of a username wins */
+		if (slot_find(t, h, name, len, &i)) {
+			++t->dupc;
+			continue;
+		}
+
+		t->slotv[i].hash = h;
+		t->slotv[i].off  = (uint32_t)off + 1;
+	}
+
+	/* release the growth slack of the arena */
+	if (t->end && t->end < t->size) {
+
+		uint8_t *arena = mem_realloc(t->arena, t->end);
+		if (arena) {
+			t->arena = arena;
+			t->size  = t->end;
+		}
+	}
+
+	return 0;
+}
+
+
+/* HA1 of a username, valid as long as the table is referenced */
+const uint8_t *restund_acctab_find(const struct restund_acctab *t,
+				   const char *username)
+{
+	size_t len;
+
+	if (!t || !t->slotv || !username)
+		return NULL;
+
+	len = strlen(username);
+
+	return slot_find(t, hash_joaat((const uint8_t *)username, len),
+			 username, len, NULL);
+}
+
+
+void restund_acctab_stat(const struct restund_acctab *t, uint32_t *n,
+			 uint32_t *dupc, size_t *bytes)
+{
+	if (!t)
+		return;
+
+	if (n)
+		*n = t->n - t->dupc;
+	if (dupc)
+		*dupc = t->dupc;
+	if (bytes)
+		*bytes = t->size + (t->mask + 1) * sizeof(*t->slotv);
+}
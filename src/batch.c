@@ -0,0 +1,395 @@
+/**
+ * @file batch.c Batched UDP I/O
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#ifdef HAVE_RECVMMSG
+#define _GNU_SOURCE 1
+#endif
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * On platforms with recvmmsg()/sendmmsg() the UDP sockets can be drained
+ * with one system call per event-loop wakeup. Datagrams are handed to the
+ * normal receive handler one by one, and datagrams queued with
+ * restund_udp_batch_send() while the batch is being processed are flushed
+ * with a single sendmmsg() when the batch is done.
+ *
+ * Without batching a socket taken over by restund_udp_batch_alloc() is
+ * read one datagram per wakeup, like a plain libre UDP socket.
+ */
+
+
+enum {
+	BATCH_MAX   = 64,
+	BATCH_RXSZ  = 8192,
+	BATCH_PRESZ = 4,
+};
+
+
+struct restund_udp_batch {
+	struct udp_sock *us;
+	struct restund_batchstat *stat;
+	udp_recv_h *rh;
+	void *arg;
+	int fd;
+};
+
+
+/* one context per event loop */
+struct batchctx {
+	struct sa rxsrc[BATCH_MAX];
+	struct mbuf *rxmb[BATCH_MAX];
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr rxv[BATCH_MAX];
+	struct iovec rxiov[BATCH_MAX];
+	struct mmsghdr txv[BATCH_MAX];
+	struct iovec txiov[BATCH_MAX];
+	struct sa txdst[BATCH_MAX];
+	struct mbuf *txmb[BATCH_MAX];
+	struct restund_batchstat *stat;
+	uint32_t txc;
+	int txfd;
+	bool active;
+#endif
+};
+
+
+static struct {
+	struct batchctx *ctxv;
+	uint32_t ctxc;
+	uint32_t size;
+} batch;
+
+
+static inline struct batchctx *batchctx(void)
+{
+	return &batch.ctxv[restund_worker_index()];
+}
+
+
+#ifdef HAVE_RECVMMSG
+static void batch_flush(struct batchctx *ctx)
+{
+	uint32_t i = 0;
+
+	while (i < ctx->txc) {
+
+		int n = sendmmsg(ctx->txfd, &ctx->txv[i], ctx->txc - i, 0);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			if (ctx->stat)
+				ctx->stat->tx_errc += ctx->txc - i;
+			break;
+		}
+
+		i += n;
+	}
+
+	if (ctx->stat && i > 0) {
+		ctx->stat->txc++;
+		ctx->stat->tx_pktc += i;
+		ctx->stat->tx_max = MAX(ctx->stat->tx_max, i);
+	}
+
+	for (i=0; i<ctx->txc; i++)
+		ctx->txmb[i] = mem_deref(ctx->txmb[i]);
+
+	ctx->txc = 0;
+	ctx->txfd = -1;
+}
+#endif
+
+
+static int batch_rxmb_prepare(struct batchctx *ctx, uint32_t n)
+{
+	uint32_t i;
+
+	for (i=0; i<n; i++) {
+
+		struct mbuf *mb = ctx->rxmb[i];
+
+		/* buffer still referenced by a handler */
+		if (mb && mem_nrefs(mb) > 1)
+			ctx->rxmb[i] = mb = mem_deref(mb);
+
+		if (!mb) {
+			mb = mbuf_alloc(BATCH_RXSZ);
+			if (!mb)
+				return ENOMEM;
+
+			ctx->rxmb[i] = mb;
+		}
+
+		mb->pos = BATCH_PRESZ;
+		mb->end = BATCH_PRESZ;
+
+#ifdef HAVE_RECVMMSG
+		ctx->rxiov[i].iov_base = mb->buf + BATCH_PRESZ;
+		ctx->rxiov[i].iov_len  = mb->size - BATCH_PRESZ;
+
+		memset(&ctx->rxv[i], 0, sizeof(ctx->rxv[i]));
+		ctx->rxv[i].msg_hdr.msg_name    = &ctx->rxsrc[i].u;
+		ctx->rxv[i].msg_hdr.msg_namelen = sizeof(ctx->rxsrc[i].u);
+		ctx->rxv[i].msg_hdr.msg_iov     = &ctx->rxiov[i];
+		ctx->rxv[i].msg_hdr.msg_iovlen  = 1;
+#endif
+	}
+
+	return 0;
+}
+
+
+static int batch_read(struct batchctx *ctx, int fd)
+{
+	struct mbuf *mb = ctx->rxmb[0];
+	struct sa *src = &ctx->rxsrc[0];
+	ssize_t n;
+
+#ifdef HAVE_RECVMMSG
+	if (batch.size) {
+		int i, c;
+
+		c = recvmmsg(fd, ctx->rxv, batch.size, MSG_DONTWAIT, NULL);
+
+		for (i=0; i<c; i++) {
+			ctx->rxsrc[i].len = ctx->rxv[i].msg_hdr.msg_namelen;
+			ctx->rxmb[i]->end = BATCH_PRESZ + ctx->rxv[i].msg_len;
+		}
+
+		return c;
+	}
+#endif
+
+	src->len = sizeof(src->u);
+	n = recvfrom(fd, (void *)mbuf_buf(mb), mb->size - BATCH_PRESZ, 0,
+		     &src->u.sa, &src->len);
+	if (n < 0)
+		return -1;
+
+	mb->end = BATCH_PRESZ + n;
+
+	return 1;
+}
+
+
+static void batch_recv(int flags, void *arg)
+{
+	struct restund_udp_batch *ub = arg;
+	struct batchctx *ctx = batchctx();
+	int i, n;
+
+	if (!(flags & FD_READ))
+		return;
+
+	if (batch_rxmb_prepare(ctx, MAX(batch.size, 1)))
+		return;
+
+	n = batch_read(ctx, ub->fd);
+	if (n <= 0)
+		return;
+
+	if (ub->stat) {
+		ub->stat->rxc++;
+		ub->stat->rx_pktc += n;
+		ub->stat->rx_max = MAX(ub->stat->rx_max, (uint32_t)n);
+	}
+
+	/* the receive handler may release the owner of the socket */
+	mem_ref(ub);
+
+#ifdef HAVE_RECVMMSG
+	ctx->stat   = ub->stat;
+	ctx->active = true;
+#endif
+
+	for (i=0; i<n; i++) {
+
+		if (ub->rh)
+			ub->rh(&ctx->rxsrc[i], ctx->rxmb[i], ub->arg);
+
+		if (mem_nrefs(ub) == 1)
+			break;
+	}
+
+#ifdef HAVE_RECVMMSG
+	batch_flush(ctx);
+
+	ctx->active = false;
+	ctx->stat   = NULL;
+#endif
+
+	mem_deref(ub);
+}
+
+
+static void batch_destructor(void *arg)
+{
+	struct restund_udp_batch *ub = arg;
+
+	if (ub->fd >= 0)
+		fd_close(ub->fd);
+
+	mem_deref(ub->us);
+}
+
+
+uint32_t restund_udp_batch_size(void)
+{
+	return batch.size;
+}
+
+
+int restund_udp_batch_alloc(struct restund_udp_batch **ubp,
+			    struct udp_sock *us, const struct sa *laddr,
+			    udp_recv_h *rh, void *arg,
+			    struct restund_batchstat *stat)
+{
+	struct restund_udp_batch *ub;
+	int err;
+
+	if (!ubp || !us || !laddr)
+		return EINVAL;
+
+	ub = mem_zalloc(sizeof(*ub), batch_destructor);
+	if (!ub)
+		return ENOMEM;
+
+	ub->fd = udp_sock_fd(us, sa_af(laddr));
+	if (ub->fd < 0) {
+		err = EBADF;
+		goto out;
+	}
+
+	ub->us   = mem_ref(us);
+	ub->stat = stat;
+	ub->rh   = rh;
+	ub->arg  = arg;
+
+	err = fd_listen(ub->fd, FD_READ, batch_recv, ub);
+	if (err) {
+		ub->fd = -1;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(ub);
+	else
+		*ubp = ub;
+
+	return err;
+}
+
+
+int restund_udp_batch_send(struct udp_sock *us, const struct sa *dst,
+			   struct mbuf *mb)
+{
+#ifdef HAVE_RECVMMSG
+	struct batchctx *ctx = batchctx();
+	struct msghdr *hdr;
+	uint32_t i;
+	int fd;
+
+	if (!us || !dst || !mb)
+		return EINVAL;
+
+	if (!ctx->active || !batch.size)
+		return udp_send(us, dst, mb);
+
+	fd = udp_sock_fd(us, sa_af(dst));
+	if (fd < 0)
+		return udp_send(us, dst, mb);
+
+	if (ctx->txc && (fd != ctx->txfd || ctx->txc >= batch.size))
+		batch_flush(ctx);
+
+	i = ctx->txc++;
+
+	ctx->txfd     = fd;
+	ctx->txdst[i] = *dst;
+	ctx->txmb[i]  = mem_ref(mb);
+
+	ctx->txiov[i].iov_base = mbuf_buf(mb);
+	ctx->txiov[i].iov_len  = mbuf_get_left(mb);
+
+	hdr = &ctx->txv[i].msg_hdr;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name    = &ctx->txdst[i].u;
+	hdr->msg_namelen = ctx->txdst[i].len;
+	hdr->msg_iov     = &ctx->txiov[i];
+	hdr->msg_iovlen  = 1;
+
+	return 0;
+#else
+	return udp_send(us, dst, mb);
+#endif
+}
+
+
+int restund_batch_init(void)
+{
+	batch.size = 0;
+
+	(void)conf_get_u32(restund_conf(), "udp_batch_size", &batch.size);
+
+#ifdef HAVE_RECVMMSG
+	batch.size = MIN(batch.size, BATCH_MAX);
+
+	if (batch.size < 2)
+		batch.size = 0;
+	else
+		restund_debug("udp batch size: %u\n", batch.size);
+#else
+	if (batch.size > 1)
+		restund_warning("udp batching not supported on this platform\n");
+
+	batch.size = 0;
+#endif
+
+	batch.ctxc = restund_worker_count();
+	batch.ctxv = mem_zalloc(batch.ctxc * sizeof(*batch.ctxv), NULL);
+	if (!batch.ctxv)
+		return ENOMEM;
+
+#ifdef HAVE_RECVMMSG
+	{
+		uint32_t i;
+
+		for (i=0; i<batch.ctxc; i++)
+			batch.ctxv[i].txfd = -1;
+	}
+#endif
+
+	return 0;
+}
+
+
+void restund_batch_close(void)
+{
+	uint32_t i, j;
+
+	for (i=0; i<batch.ctxc; i++) {
+
+		struct batchctx *ctx = &batch.ctxv[i];
+
+		for (j=0; j<BATCH_MAX; j++) {
+			ctx->rxmb[j] = mem_deref(ctx->rxmb[j]);
+#ifdef HAVE_RECVMMSG
+			ctx->txmb[j] = mem_deref(ctx->txmb[j]);
+#endif
+		}
+	}
+
+	batch.ctxv = mem_deref(batch.ctxv);
+	batch.ctxc = 0;
+}
@@ -17,31 +17,85 @@ struct account {
 	struct le he;
 	char *username;
 	uint8_t ha1[MD5_SIZE];
+	bool deleted;
 };
 
 
-struct traffic {
-	struct le le;
-	struct restund_trafstat ts;
-	struct sa cli;
-	struct sa relay;
-	struct sa peer;
+/* a published hash table, flushed when the last reference is gone */
+struct table {
+	struct hash *ht;
+	uint32_t count;
+};
+
+
+/*
+ * Accounts are looked up in the delta table first, which holds the
+ * changes applied since the base table was loaded by a full sync.
+ * A full sync is forced once the delta holds more than 1/DELTA_RATIO
+ * of the base accounts, so lookups and delta rebuilds stay cheap.
+ */
+struct credtab {
+	struct restund_acctab *base;
+	struct table *delta;
+};
+
+
+struct limit {
+	struct le he;
 	char *username;
-	time_t start;
-	time_t end;
+	struct restund_limits lim;
+};
+
+
+enum {
+	LIMIT_HASH_SIZE = 256,
+	DELTA_HASH_MIN  = 16,
+	DELTA_MIN       = 1024,
+	DELTA_RATIO     = 8,
+};
+
+
+/*
+ * Traffic records are passed to the database thread through a bounded
+ * lock-free ring of fixed-size records. Any event loop may produce, the
+ * database thread is the only consumer. Each slot carries a sequence
+ * number telling whether it is free for position pos (seq == pos) or
+ * holds the record of position pos (seq == pos + 1). A full ring drops
+ * the record and counts it.
+ */
+struct tslot {
+	uint64_t seq;
+	struct restund_traffic rec;
+};
+
+
+enum {
+	TRAFFIC_QUEUE_DEFAULT = 8192,
+	TRAFFIC_BATCH         = 256,
 };
 
 
 static struct {
 	struct {
-		pthread_mutex_t mutex;
-		struct hash *ht;
+		struct credtab *tab;
+		struct table *lim;
+		uint64_t version;
 		uint32_t syncint;
+		uint32_t deltaint;
+		bool delta;
 	} cred;
 	struct {
-		struct list fifo;
+		struct tslot *slotv;
+		uint64_t mask;
+		uint64_t head;              /* next position to produce */
+		uint64_t tail;              /* next position to consume */
+		uint64_t dropc;
+		uint64_t dropc_rep;
+		struct restund_traffic *batchv;
+		size_t batchc;
 		pthread_mutex_t mutex;
 		pthread_cond_t cond;
+		bool wake;
 	} traffic;
 	pthread_t thread;
 	char realm[256];
@@ -50,9 +104,9 @@ static struct {
 	bool run;
 } database = {
 	.cred = {
-		  .mutex   = PTHREAD_MUTEX_INITIALIZER,
-		  .ht      = NULL,
-		  .syncint = 3600,
+		  .tab      = NULL,
+		  .syncint  = 3600,
+		  .deltaint = 0,
 	},
 	.traffic = {
 		  .mutex = PTHREAD_MUTEX_INITIALIZER,
@@ -66,6 +120,86 @@ static struct {
 };
 
 
+/*
+ * The credential and limit tables are published with restund_rcu_*,
+ * lookups never lock.
+ */
+static inline void *rcu_dereference(void **pp)
+{
+	return __atomic_load_n(pp, __ATOMIC_SEQ_CST);
+}
+
+
+/* publish a new object and release the old one after a grace period */
+static void rcu_replace(void **pp, void *p)
+{
+	void *old;
+
+	old = __atomic_exchange_n(pp, p, __ATOMIC_SEQ_CST);
+	if (!old)
+		return;
+
+	restund_rcu_synchronize();
+
+	mem_deref(old);
+}
+
+
+static void table_destructor(void *arg)
+{
+	struct table *t = arg;
+
+	hash_flush(t->ht);
+	mem_deref(t->ht);
+}
+
+
+static int table_alloc(struct table **tp, uint32_t bsize)
+{
+	struct table *t;
+	int err;
+
+	t = mem_zalloc(sizeof(*t), table_destructor);
+	if (!t)
+		return ENOMEM;
+
+	err = hash_alloc(&t->ht, bsize);
+	if (err)
+		mem_deref(t);
+	else
+		*tp = t;
+
+	return err;
+}
+
+
+static void credtab_destructor(void *arg)
+{
+	struct credtab *tab = arg;
+
+	mem_deref(tab->base);
+	mem_deref(tab->delta);
+}
+
+
+static int credtab_alloc(struct credtab **tabp, struct restund_acctab *base,
+			 struct table *delta)
+{
+	struct credtab *tab;
+
+	tab = mem_zalloc(sizeof(*tab), credtab_destructor);
+	if (!tab)
+		return ENOMEM;
+
+	tab->base  = mem_ref(base);
+	tab->delta = mem_ref(delta);
+
+	*tabp = tab;
+
+	return 0;
+}
+
+
 static bool hash_cmp_handler(struct le *le, void *arg)
 {
 	const struct account *acc = le->data;
@@ -83,85 +217,419 @@ static void account_destructor(void *arg)
 }
 
 
-static int account_handler(const char *username, const char *ha1, void *arg)
+static struct account *account_find(const struct table *t,
+				    const char *username)
+{
+	if (!t)
+		return NULL;
+
+	return list_ledata(hash_lookup(t->ht, hash_joaat_str(username),
+				       hash_cmp_handler, (void *)username));
+}
+
+
+static int account_alloc(struct account **accp, const char *username,
+			 const uint8_t *ha1, bool deleted)
 {
-	struct hash *ht = arg;
 	struct account *acc;
-	int err = ENOMEM;
-	size_t len;
+	int err;
 
 	acc = mem_zalloc(sizeof(struct account), account_destructor);
 	if (!acc)
-		goto out;
+		return ENOMEM;
 
-	len = strlen(username);
+	err = str_dup(&acc->username, username);
+	if (err) {
+		mem_deref(acc);
+		return err;
+	}
 
-	acc->username = mem_alloc(len + 1, NULL);
-	if (!acc->username)
-		goto out;
+	if (ha1)
+		memcpy(acc->ha1, ha1, MD5_SIZE);
+
+	acc->deleted = deleted;
+
+	*accp = acc;
+
+	return 0;
+}
 
-	memcpy(acc->username, username, len + 1);
 
-	err = str_hex(acc->ha1, MD5_SIZE, ha1);
+/* insert acc into the unpublished table t, replacing an older change */
+static void account_upsert(struct table *t, struct account *acc)
+{
+	struct account *old;
+
+	old = account_find(t, acc->username);
+	if (old) {
+		memcpy(old->ha1, acc->ha1, MD5_SIZE);
+		old->deleted = acc->deleted;
+		mem_deref(acc);
+		return;
+	}
+
+	hash_append(t->ht, hash_joaat_str(acc->username), &acc->he, acc);
+	++t->count;
+}
+
+
+static int account_handler(const char *username, const char *ha1, void *arg)
+{
+	uint8_t md5[MD5_SIZE];
+	int err;
+
+	err = str_hex(md5, MD5_SIZE, ha1);
 	if (err)
-		goto out;
+		return err;
 
-	hash_append(ht, hash_joaat_str(acc->username), &acc->he, acc);
+	return restund_acctab_add(arg, username, md5);
+}
 
-	err = 0;
 
- out:
+static bool delta_copy_handler(struct le *le, void *arg)
+{
+	const struct account *acc = le->data;
+	struct table *t = arg;
+	struct account *cpy;
+
+	if (account_alloc(&cpy, acc->username, acc->ha1, acc->deleted))
+		return true;
+
+	hash_append(t->ht, hash_joaat_str(cpy->username), &cpy->he, cpy);
+	++t->count;
+
+	return false;
+}
+
+
+/* queue an upsert (ha1 set) or delete (ha1 NULL) of an account */
+static int delta_handler(const char *username, const char *ha1, void *arg)
+{
+	struct list *chgl = arg;
+	struct account *acc;
+	uint8_t md5[MD5_SIZE];
+	int err;
+
+	if (ha1) {
+		err = str_hex(md5, MD5_SIZE, ha1);
+		if (err)
+			return err;
+	}
+
+	err = account_alloc(&acc, username, ha1 ? md5 : NULL, !ha1);
 	if (err)
-		mem_deref(acc);
+		return err;
 
-	return err;
+	list_append(chgl, &acc->he, acc);
+
+	return 0;
 }
 
 
 static int sync_credentials(void)
 {
-	struct hash *ht = NULL, *ht_old;
-	uint32_t n, x, sz;
+	struct restund_acctab *t = NULL;
+	struct credtab *tab = NULL;
+	uint64_t version = 0, start, built;
+	uint32_t n = 0, cnt = 0, dupc = 0;
+	bool delta = false;
+	size_t bytes = 0;
 	int err = 0;
 
-	if (!database.db || !database.db->allh || !database.db->cnth)
+	if (!database.db || !database.db->allh)
 		goto out;
 
-	err = database.db->cnth(database.realm, &n);
-	if (err) {
-		restund_warning("database sync error (cnt): %m\n", err);
-		goto out;
+	start = tmr_jiffies();
+
+	/* changes made during the full load are applied again later */
+	if (database.db->deltah) {
+		err = database.db->deltah(database.realm, &version, NULL, NULL);
+		if (err)
+			restund_debug("database delta sync not available: %m\n",
+				      err);
+		else
+			delta = true;
 	}
 
-	for (x=2; (uint32_t)1<<x<n; x++);
-	sz = 1<<x;
+	/* without a count the table grows on demand */
+	if (database.db->cnth) {
+		err = database.db->cnth(database.realm, &n);
+		if (err) {
+			restund_warning("database sync error (cnt): %m\n",
+					err);
+			goto out;
+		}
+	}
 
-	err = hash_alloc(&ht, sz);
+	err = restund_acctab_alloc(&t, n);
 	if (err) {
-		restund_warning("database: unable to create hashtable: %m\n",
+		restund_warning("database: unable to create table: %m\n",
 				err);
 		goto out;
 	}
 
-	err = database.db->allh(database.realm, account_handler, ht);
+	err = database.db->allh(database.realm, account_handler, t);
 	if (err) {
 		restund_warning("database sync error (all): %m\n", err);
 		goto out;
 	}
 
-	pthread_mutex_lock(&database.cred.mutex);
-	ht_old = database.cred.ht;
-	database.cred.ht = ht;
-	pthread_mutex_unlock(&database.cred.mutex);
+	built = tmr_jiffies();
+
+	err = restund_acctab_build(t);
+	if (err) {
+		restund_warning("database: unable to index table: %m\n", err);
+		goto out;
+	}
+
+	restund_acctab_stat(t, &cnt, &dupc, &bytes);
+
+	err = credtab_alloc(&tab, t, NULL);
+	if (err)
+		goto out;
+
+	rcu_replace((void **)&database.cred.tab, tab);
+
+	database.cred.version = version;
+	database.cred.delta   = delta;
+
+	restund_info("database synced: %u accounts (%u duplicates),"
+		     " %zu bytes, load %llu ms, index %llu ms\n",
+		     cnt, dupc, bytes, built - start, tmr_jiffies() - built);
+
+ out:
+	mem_deref(t);
+
+	return err;
+}
+
+
+/*
+ * Apply the account changes since the last sync to a copy of the delta
+ * table. EOVERFLOW asks for a full sync once the delta has grown large.
+ */
+static int sync_delta(void)
+{
+	const struct credtab *cur = database.cred.tab;
+	struct credtab *tab = NULL;
+	struct table *t = NULL;
+	uint64_t version = database.cred.version;
+	uint32_t n, basec = 0;
+	struct list chgl;
+	struct le *le;
+	int err;
+
+	if (!cur || !database.cred.delta)
+		return 0;
+
+	list_init(&chgl);
+
+	err = database.db->deltah(database.realm, &version,
+				  delta_handler, &chgl);
+	if (err) {
+		restund_warning("database sync error (delta): %m\n", err);
+		goto out;
+	}
+
+	if (version == database.cred.version)
+		goto out;
+
+	n = list_count(&chgl) + (cur->delta ? cur->delta->count : 0);
+
+	err = table_alloc(&t, hash_valid_size(MAX(n, DELTA_HASH_MIN)));
+	if (err)
+		goto out;
+
+	if (cur->delta &&
+	    hash_apply(cur->delta->ht, delta_copy_handler, t)) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	/* the new delta table is not published yet */
+	while ((le = list_head(&chgl))) {
+
+		struct account *acc = le->data;
+
+		list_unlink(le);
+		account_upsert(t, acc);
+	}
+
+	restund_acctab_stat(cur->base, &basec, NULL, NULL);
+
+	err = credtab_alloc(&tab, cur->base, t);
+	if (err)
+		goto out;
+
+	rcu_replace((void **)&database.cred.tab, tab);
+
+	restund_debug("database delta synced (version %llu -> %llu,"
+		      " %u accounts)\n",
+		      database.cred.version, version, t->count);
+
+	database.cred.version = version;
+
+	if (t->count > MAX(DELTA_MIN, basec / DELTA_RATIO))
+		err = EOVERFLOW;
+
+ out:
+	list_flush(&chgl);
+	mem_deref(t);
+
+	return err;
+}
+
+
+static bool limit_cmp_handler(struct le *le, void *arg)
+{
+	const struct limit *lim = le->data;
+
+	return !strcmp(lim->username, arg);
+}
+
+
+static void limit_destructor(void *arg)
+{
+	struct limit *lim = arg;
+
+	mem_deref(lim->username);
+}
+
+
+static int limit_handler(const char *username,
+			 const struct restund_limits *rl, void *arg)
+{
+	struct hash *ht = arg;
+	struct limit *lim;
+	int err;
+
+	lim = mem_zalloc(sizeof(*lim), limit_destructor);
+	if (!lim)
+		return ENOMEM;
+
+	err = str_dup(&lim->username, username);
+	if (err) {
+		mem_deref(lim);
+		return err;
+	}
+
+	lim->lim = *rl;
+	hash_append(ht, hash_joaat_str(lim->username), &lim->he, lim);
+
+	return 0;
+}
+
+
+static int sync_limits(void)
+{
+	struct table *t = NULL;
+	int err;
+
+	if (!database.db || !database.db->limh)
+		return 0;
+
+	err = table_alloc(&t, LIMIT_HASH_SIZE);
+	if (err)
+		goto out;
 
-	ht = ht_old;
+	err = database.db->limh(database.realm, limit_handler, t->ht);
+	if (err) {
+		restund_warning("database sync error (limits): %m\n", err);
+		goto out;
+	}
 
-	restund_debug("database successfully synced (n=%u hashsize=%u)\n",
-		      n, sz);
+	rcu_replace((void **)&database.cred.lim, t);
+	t = NULL;
 
  out:
-	hash_flush(ht);
-	mem_deref(ht);
+	mem_deref(t);
+
+	return err;
+}
+
+
+static bool traffic_push(const struct restund_traffic *rec)
+{
+	struct tslot *slot;
+	uint64_t pos;
+
+	pos = __atomic_load_n(&database.traffic.head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		int64_t diff;
+
+		slot = &database.traffic.slotv[pos & database.traffic.mask];
+		diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)
+				 - pos);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&database.traffic.head,
+							&pos, pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0) {
+			return false;
+		}
+		else {
+			pos = __atomic_load_n(&database.traffic.head,
+					      __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->rec = *rec;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+
+/* database thread only */
+static bool traffic_pop(struct restund_traffic *rec)
+{
+	const uint64_t pos = database.traffic.tail;
+	struct tslot *slot;
+
+	slot = &database.traffic.slotv[pos & database.traffic.mask];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return false;
+
+	*rec = slot->rec;
+	__atomic_store_n(&slot->seq, pos + database.traffic.mask + 1,
+			 __ATOMIC_RELEASE);
+
+	database.traffic.tail = pos + 1;
+
+	return true;
+}
+
+
+static int traffic_write(const struct restund_traffic *trv, size_t trc,
+			 size_t *nw)
+{
+	int err = 0;
+	size_t i;
+
+	if (database.db->tlogbh) {
+		err = database.db->tlogbh(database.realm, trv, trc);
+		*nw = err ? 0 : trc;
+		return err;
+	}
+
+	for (i=0; i<trc; i++) {
+
+		const struct restund_traffic *tr = &trv[i];
+
+		err = database.db->tlogh(tr->username, &tr->cli, &tr->relay,
+					 &tr->peer, database.realm,
+					 tr->start, tr->end, &tr->ts);
+		if (err)
+			break;
+	}
+
+	*nw = i;
 
 	return err;
 }
@@ -169,46 +637,87 @@ static int sync_credentials(void)
 
 static int save_traffic_records(void)
 {
+	struct restund_traffic *batchv = database.traffic.batchv;
+	uint64_t dropc;
 	int err = 0;
 
+	if (!batchv)
+		return 0;
+
 	for (;;) {
-		struct traffic *trf;
+		size_t n;
 
-		pthread_mutex_lock(&database.traffic.mutex);
+		/* the records of a failed batch are written first */
+		while (database.traffic.batchc < TRAFFIC_BATCH &&
+		       traffic_pop(&batchv[database.traffic.batchc]))
+			++database.traffic.batchc;
 
-		trf = list_ledata(list_head(&database.traffic.fifo));
-		if (!trf) {
-			pthread_mutex_unlock(&database.traffic.mutex);
+		if (!database.traffic.batchc)
 			break;
-		}
 
-		list_unlink(&trf->le);
-		pthread_mutex_unlock(&database.traffic.mutex);
+		err = traffic_write(batchv, database.traffic.batchc, &n);
 
-		/* database insert */
-		if (database.db && database.db->tlogh)
-			err = database.db->tlogh(trf->username, &trf->cli,
-						 &trf->relay, &trf->peer,
-						 database.realm,
-						 trf->start, trf->end,
-						 &trf->ts);
+		database.traffic.batchc -= n;
+		memmove(batchv, batchv + n,
+			database.traffic.batchc * sizeof(*batchv));
 
 		if (err) {
-			restund_warning("error writing traffic record;"
-					" retry later\n");
-			pthread_mutex_lock(&database.traffic.mutex);
-			list_prepend(&database.traffic.fifo, &trf->le, trf);
-			pthread_mutex_unlock(&database.traffic.mutex);
+			restund_warning("error writing traffic records (%m);"
+					" retry later\n", err);
 			break;
 		}
+	}
 
-		mem_deref(trf);
+	dropc = __atomic_load_n(&database.traffic.dropc, __ATOMIC_RELAXED);
+	if (dropc != database.traffic.dropc_rep) {
+		restund_warning("traffic queue full: %llu records dropped\n",
+				dropc - database.traffic.dropc_rep);
+		database.traffic.dropc_rep = dropc;
 	}
 
 	return err;
 }
 
 
+static void traffic_close(void)
+{
+	database.traffic.slotv  = mem_deref(database.traffic.slotv);
+	database.traffic.batchv = mem_deref(database.traffic.batchv);
+	database.traffic.batchc = 0;
+}
+
+
+static int traffic_init(void)
+{
+	uint32_t size = TRAFFIC_QUEUE_DEFAULT, sz = 2;
+	uint32_t i;
+
+	(void)conf_get_u32(restund_conf(), "traffic_queue_size", &size);
+
+	while (sz < size && sz < 0x80000000u)
+		sz <<= 1;
+
+	database.traffic.slotv = mem_zalloc(sz * sizeof(struct tslot), NULL);
+	database.traffic.batchv = mem_zalloc(TRAFFIC_BATCH *
+					     sizeof(struct restund_traffic),
+					     NULL);
+	if (!database.traffic.slotv || !database.traffic.batchv) {
+		traffic_close();
+		return ENOMEM;
+	}
+
+	for (i=0; i<sz; i++)
+		database.traffic.slotv[i].seq = i;
+
+	database.traffic.mask   = sz - 1;
+	database.traffic.head   = 0;
+	database.traffic.tail   = 0;
+	database.traffic.batchc = 0;
+
+	return 0;
+}
+
+
 static void gettimespec(struct timespec *ts, uint32_t offset)
 {
 	struct timeval tv;
@@ -220,10 +729,21 @@ static void gettimespec(struct timespec *ts, uint32_t offset)
 }
 
 
+static bool timespec_passed(const struct timespec *ts)
+{
+	struct timespec now;
+
+	gettimespec(&now, 0);
+
+	return now.tv_sec > ts->tv_sec ||
+		(now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+
 static void *database_thread(void *arg)
 {
 	struct timespec ts;
-	int err = 0;
+	time_t full = 0;
 	(void)arg;
 
 	gettimespec(&ts, 0);
@@ -233,12 +753,15 @@ static void *database_thread(void *arg)
 
 		pthread_mutex_lock(&database.traffic.mutex);
 		quit = database.quit;
-		if (!quit) {
-			err = pthread_cond_timedwait(&database.traffic.cond,
+		if (!quit && !__atomic_load_n(&database.traffic.wake,
+						 __ATOMIC_ACQUIRE)) {
+			(void)pthread_cond_timedwait(&database.traffic.cond,
 						     &database.traffic.mutex,
 						     &ts);
 			quit = database.quit;
 		}
+		__atomic_store_n(&database.traffic.wake, false,
+				 __ATOMIC_RELEASE);
 		pthread_mutex_unlock(&database.traffic.mutex);
 
 		(void)save_traffic_records();
@@ -246,11 +769,26 @@ static void *database_thread(void *arg)
 		if (quit)
 			break;
 
-		if (err != ETIMEDOUT)
+		if (!timespec_passed(&ts))
 			continue;
 
-		(void)sync_credentials();
-		gettimespec(&ts, database.cred.syncint);
+		if (!database.cred.delta || !database.cred.deltaint ||
+		    time(NULL) >= full) {
+
+			(void)sync_credentials();
+			(void)sync_limits();
+			full = time(NULL) + database.cred.syncint;
+		}
+		else if (sync_delta()) {
+			/* failed or large delta, replace it with a full sync */
+			full = 0;
+		}
+
+		if (database.cred.delta && database.cred.deltaint)
+			gettimespec(&ts, MIN(database.cred.deltaint,
+					     database.cred.syncint));
+		else
+			gettimespec(&ts, database.cred.syncint);
 	}
 
 	restund_debug("database thread exit\n");
@@ -259,60 +797,53 @@ static void *database_thread(void *arg)
 }
 
 
-static void traffic_destructor(void *arg)
-{
-	struct traffic *trf = arg;
-
-	trf->username = mem_deref(trf->username);
-}
-
-
 int restund_log_traffic(const char *username, const struct sa *cli,
 			const struct sa *relay, const struct sa *peer,
 			time_t start, time_t end,
 			const struct restund_trafstat *ts)
 {
-	struct traffic *trf = NULL;
-	int err = ENOMEM;
+	struct restund_traffic tr;
 
 	if (!cli || !relay || !peer || !ts)
 		return EINVAL;
 
-	if (!database.run || !database.db || !database.db->tlogh)
+	if (!database.run || !database.traffic.slotv)
 		return 0;
 
-	trf = mem_zalloc(sizeof(struct traffic), traffic_destructor);
-	if (!trf)
-		goto out;
+	(void)str_ncpy(tr.username, username ? username : "",
+		       sizeof(tr.username));
 
-	err = str_dup(&trf->username, username ? username : "");
-	if (err)
-		goto out;
+	tr.cli   = *cli;
+	tr.relay = *relay;
+	tr.peer  = *peer;
+	tr.start = start;
+	tr.end   = end;
+	tr.ts    = *ts;
 
-	trf->cli   = *cli;
-	trf->relay = *relay;
-	trf->peer  = *peer;
-	trf->start = start;
-	trf->end   = end;
-	trf->ts    = *ts;
-
-	pthread_mutex_lock(&database.traffic.mutex);
-	list_append(&database.traffic.fifo, &trf->le, trf);
-	pthread_cond_signal(&database.traffic.cond);
-	pthread_mutex_unlock(&database.traffic.mutex);
+	/* drops are reported by the database thread */
+	if (!traffic_push(&tr)) {
+		__atomic_add_fetch(&database.traffic.dropc, 1,
+				   __ATOMIC_RELAXED);
+		return 0;
+	}
 
-	err = 0;
-out:
-	if (err)
-		mem_deref(trf);
+	/* the database thread is woken once per batch */
+	if (!__atomic_exchange_n(&database.traffic.wake, true,
+				 __ATOMIC_ACQ_REL)) {
+		pthread_mutex_lock(&database.traffic.mutex);
+		pthread_cond_signal(&database.traffic.cond);
+		pthread_mutex_unlock(&database.traffic.mutex);
+	}
 
-	return err;
+	return 0;
 }
 
 
 int restund_get_ha1(const char *username, uint8_t *ha1)
 {
-	struct account *acc;
+	const struct credtab *tab;
+	const struct account *acc;
+	const uint8_t *rec = NULL;
 	int err = ENOENT;
 
 	if (!username || !ha1)
@@ -321,19 +852,62 @@ int restund_get_ha1(const char *username, uint8_t *ha1)
 	if (!database.run)
 		return ENOENT;
 
-	pthread_mutex_lock(&database.cred.mutex);
+	restund_rcu_read_lock();
 
-	acc = list_ledata(hash_lookup(database.cred.ht,
-				      hash_joaat_str(username),
-				      hash_cmp_handler, (void *)username));
-	if (!acc)
+	/* the back-end has its own table */
+	if (database.db->ha1h) {
+		err = database.db->ha1h(username, ha1);
+		goto out;
+	}
+
+	tab = rcu_dereference((void **)&database.cred.tab);
+	if (tab) {
+		acc = account_find(tab->delta, username);
+		if (acc)
+			rec = acc->deleted ? NULL : acc->ha1;
+		else
+			rec = restund_acctab_find(tab->base, username);
+	}
+
+	if (!rec)
 		goto out;
 
-	memcpy(ha1, acc->ha1, MD5_SIZE);
+	memcpy(ha1, rec, MD5_SIZE);
 
 	err = 0;
  out:
-	pthread_mutex_unlock(&database.cred.mutex);
+	restund_rcu_read_unlock();
+
+	return err;
+}
+
+
+/* per-user relay limits from the database, ENOENT if none */
+int restund_get_limits(const char *username, struct restund_limits *lim)
+{
+	const struct table *t;
+	struct limit *l = NULL;
+	int err = ENOENT;
+
+	if (!username || !lim)
+		return EINVAL;
+
+	if (!database.run)
+		return ENOENT;
+
+	restund_rcu_read_lock();
+
+	t = rcu_dereference((void **)&database.cred.lim);
+	if (t)
+		l = list_ledata(hash_lookup(t->ht, hash_joaat_str(username),
+					    limit_cmp_handler,
+					    (void *)username));
+	if (l) {
+		*lim = l->lim;
+		err = 0;
+	}
+
+	restund_rcu_read_unlock();
 
 	return err;
 }
@@ -362,13 +936,22 @@ int restund_db_init(void)
 	/* syncinterval config */
 	(void)conf_get_u32(restund_conf(), "syncinterval",
 			   &database.cred.syncint);
+	(void)conf_get_u32(restund_conf(), "sync_delta_interval",
+			   &database.cred.deltaint);
 
 	if (!database.db)
 		return 0;
 
+	if (database.db->tlogh || database.db->tlogbh) {
+		err = traffic_init();
+		if (err)
+			return err;
+	}
+
 	err = pthread_create(&database.thread, NULL, database_thread, NULL);
 	if (err) {
 		restund_warning("database thread error: %m\n", err);
+		traffic_close();
 		return err;
 	}
 
@@ -383,8 +966,6 @@ int restund_db_init(void)
 
 void restund_db_close(void)
 {
-	struct hash *ht;
-
 	if (database.run) {
 		pthread_mutex_lock(&database.traffic.mutex);
 		database.quit = true;
@@ -395,19 +976,9 @@ void restund_db_close(void)
 		database.run = false;
 	}
 
-	pthread_mutex_lock(&database.traffic.mutex);
-	list_flush(&database.traffic.fifo);
-	list_init(&database.traffic.fifo);
-	pthread_mutex_unlock(&database.traffic.mutex);
-
-	pthread_mutex_lock(&database.cred.mutex);
-	ht = database.cred.ht;
-	database.cred.ht = NULL;
-	pthread_mutex_unlock(&database.cred.mutex);
-
-	if (!ht)
-		return;
+	traffic_close();
 
-	hash_flush(ht);
-	mem_deref(ht);
+	rcu_replace((void **)&database.cred.tab, NULL);
+	rcu_replace((void **)&database.cred.lim, NULL);
+	database.cred.delta = false;
 }
@@ -151,8 +151,9 @@ int main(int argc, char *argv[])
 #endif
 
 	restund_cmd_subscribe(&cmd_reload);
+	restund_stun_init();
 
-	err = fd_setsize(4096);
+	err = fd_setsize(MAX_FDS);
 	if (err) {
 		restund_warning("fd_setsize error: %m\n", err);
 		goto out;
@@ -176,6 +177,21 @@ int main(int argc, char *argv[])
 	if (!conf_get(conf, "debug", &opt) && !pl_strcasecmp(&opt, "yes"))
 		restund_log_enable_debug(true);
 
+	/* worker threads */
+	err = restund_worker_init();
+	if (err)
+		goto out;
+
+	/* udp batch */
+	err = restund_batch_init();
+	if (err)
+		goto out;
+
+	/* request rate limiter */
+	err = restund_ratelimit_init();
+	if (err)
+		goto out;
+
 	/* udp */
 	err = restund_udp_init();
 	if (err)
@@ -216,20 +232,29 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	/* worker threads */
+	err = restund_worker_start();
+	if (err)
+		goto out;
+
 	restund_info("stun server ready\n");
 
 	/* main loop */
 	err = re_main(signal_handler);
 
  out:
+	restund_udp_close();
 	restund_db_close();
 	mod_close();
-	restund_udp_close();
+	restund_worker_close();
 	restund_tcp_close();
+	restund_batch_close();
+	restund_ratelimit_close();
 	conf = mem_deref(conf);
 
 	libre_close();
 
+	restund_stun_close();
 	restund_cmd_unsubscribe(&cmd_reload);
 
 	/* check for memory leaks */
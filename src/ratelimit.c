@@ -0,0 +1,303 @@
+/**
+ * @file ratelimit.c Per-source Request Rate Limiter
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * STUN requests are rate limited per source address prefix before they
+ * are decoded. Every event loop owns a fixed-size set-associative table
+ * of token buckets, one bucket per method class. The set is chosen by a
+ * hash seeded at startup, so colliding prefixes can not be computed
+ * offline. A source missing from its set replaces an entry with full
+ * buckets, or else the least recently seen one. New entries start with
+ * a single request's worth of tokens, so evicting a source does not
+ * refill its bucket. Excess requests are silently dropped.
+ */
+
+
+enum {
+	RL_SETS   = 1024,
+	RL_WAYS   = 4,
+};
+
+enum rl_class {
+	RL_BINDING = 0,
+	RL_ALLOCATE,
+	RL_OTHER,
+	RL_MAX
+};
+
+
+struct rlent {
+	uint64_t ts;
+	uint32_t key;
+	uint32_t tokens[RL_MAX];  /* 1/1000 requests */
+};
+
+/* one table per event loop */
+struct rltab {
+	struct rlent entv[RL_SETS][RL_WAYS];
+	uint64_t dropc[RL_MAX];
+};
+
+
+static struct {
+	struct rltab *tabv;
+	uint32_t tabc;
+	uint32_t ratev[RL_MAX];
+	uint32_t prefix4;
+	uint32_t prefix6;
+	uint64_t seed;
+	bool enabled;
+} rl;
+
+
+static const char *class_name[RL_MAX] = {
+	"binding",
+	"allocate",
+	"other",
+};
+
+
+static enum rl_class method_class(uint16_t method)
+{
+	switch (method) {
+
+	case STUN_METHOD_BINDING:
+		return RL_BINDING;
+
+	case STUN_METHOD_ALLOCATE:
+		return RL_ALLOCATE;
+
+	default:
+		return RL_OTHER;
+	}
+}
+
+
+static uint32_t source_key(const struct sa *src)
+{
+	uint8_t buf[sizeof(rl.seed) + 16], *addr = buf + sizeof(rl.seed);
+	uint32_t i, bits, len, key;
+
+	memcpy(buf, &rl.seed, sizeof(rl.seed));
+
+	switch (sa_af(src)) {
+
+	case AF_INET:
+		memcpy(addr, &src->u.in.sin_addr, 4);
+		len  = 4;
+		bits = rl.prefix4;
+		break;
+
+#ifdef HAVE_INET6
+	case AF_INET6:
+		memcpy(addr, &src->u.in6.sin6_addr, 16);
+		len  = 16;
+		bits = rl.prefix6;
+		break;
+#endif
+
+	default:
+		return 0;
+	}
+
+	for (i=0; i<len; i++) {
+
+		if (bits >= 8)
+			bits -= 8;
+		else {
+			addr[i] &= 0xff << (8 - bits);
+			bits = 0;
+		}
+	}
+
+	key = hash_joaat(buf, sizeof(rl.seed) + len);
+
+	return key ? key : 1;
+}
+
+
+/* true if all buckets of ent have refilled by now */
+static bool entry_full(const struct rlent *ent, uint64_t now)
+{
+	uint32_t i;
+
+	if (!ent->key)
+		return true;
+
+	for (i=0; i<RL_MAX; i++) {
+
+		const uint64_t max = rl.ratev[i] * 1000;
+
+		if (ent->tokens[i] + (now - MIN(now, ent->ts)) * rl.ratev[i]
+		    < max)
+			return false;
+	}
+
+	return true;
+}
+
+
+static struct rlent *entry_get(struct rltab *tab, uint32_t key, uint64_t now)
+{
+	struct rlent *setv = tab->entv[key & (RL_SETS - 1)];
+	struct rlent *old = NULL, *lru = &setv[0];
+	uint32_t i;
+
+	for (i=0; i<RL_WAYS; i++) {
+
+		if (setv[i].key == key)
+			return &setv[i];
+
+		if (!old && entry_full(&setv[i], now))
+			old = &setv[i];
+
+		if (setv[i].ts < lru->ts)
+			lru = &setv[i];
+	}
+
+	if (!old)
+		old = lru;
+
+	old->key = key;
+	old->ts  = now;
+
+	for (i=0; i<RL_MAX; i++)
+		old->tokens[i] = MIN(rl.ratev[i] * 1000, 1000);
+
+	return old;
+}
+
+
+/* false if the STUN request in mb exceeds the rate of its source */
+bool restund_ratelimit_check(const struct sa *src, const struct mbuf *mb)
+{
+	enum rl_class cls;
+	struct rlent *ent;
+	uint16_t type;
+	uint32_t key, rate, max;
+	uint64_t now;
+
+	if (!rl.enabled || mbuf_get_left(mb) < 2)
+		return true;
+
+	type = mbuf_buf(mb)[0] << 8 | mbuf_buf(mb)[1];
+
+	/* requests only, class bits C1 and C0 zero */
+	if (type & 0x0110)
+		return true;
+
+	cls  = method_class((type & 0x000f) | ((type & 0x00e0) >> 1) |
+			    ((type & 0x3e00) >> 2));
+	rate = rl.ratev[cls];
+	if (!rate)
+		return true;
+
+	key = source_key(src);
+	if (!key)
+		return true;
+
+	now = tmr_jiffies();
+	ent = entry_get(&rl.tabv[restund_worker_index()], key, now);
+
+	if (now > ent->ts) {
+		uint32_t i;
+
+		for (i=0; i<RL_MAX; i++) {
+			max = rl.ratev[i] * 1000;
+			ent->tokens[i] = (uint32_t)MIN(max, ent->tokens[i] +
+						       (now - ent->ts) *
+						       rl.ratev[i]);
+		}
+
+		ent->ts = now;
+	}
+
+	if (ent->tokens[cls] < 1000) {
+		++rl.tabv[restund_worker_index()].dropc[cls];
+		return false;
+	}
+
+	ent->tokens[cls] -= 1000;
+
+	return true;
+}
+
+
+void restund_ratelimit_stat(struct mbuf *mb)
+{
+	uint32_t i, j;
+
+	for (j=0; j<RL_MAX; j++) {
+
+		uint64_t dropc = 0;
+
+		for (i=0; i<rl.tabc; i++)
+			dropc += rl.tabv[i].dropc[j];
+
+		(void)mbuf_printf(mb, "ratelimit_drop_%s %llu\n",
+				  class_name[j], dropc);
+	}
+}
+
+
+int restund_ratelimit_init(void)
+{
+	uint32_t i;
+
+	memset(rl.ratev, 0, sizeof(rl.ratev));
+	rl.prefix4 = 32;
+	rl.prefix6 = 64;
+	rl.seed = rand_u64();
+
+	(void)conf_get_u32(restund_conf(), "ratelimit_binding",
+			   &rl.ratev[RL_BINDING]);
+	(void)conf_get_u32(restund_conf(), "ratelimit_allocate",
+			   &rl.ratev[RL_ALLOCATE]);
+	(void)conf_get_u32(restund_conf(), "ratelimit_other",
+			   &rl.ratev[RL_OTHER]);
+	(void)conf_get_u32(restund_conf(), "ratelimit_prefix4", &rl.prefix4);
+	(void)conf_get_u32(restund_conf(), "ratelimit_prefix6", &rl.prefix6);
+
+	rl.prefix4 = MIN(rl.prefix4, 32);
+	rl.prefix6 = MIN(rl.prefix6, 128);
+	rl.enabled = false;
+
+	for (i=0; i<RL_MAX; i++) {
+		/* keep the scaled tokens within 32 bits */
+		rl.ratev[i] = MIN(rl.ratev[i], 1000000);
+		if (rl.ratev[i])
+			rl.enabled = true;
+	}
+
+	rl.tabc = restund_worker_count();
+	rl.tabv = mem_zalloc(rl.tabc * sizeof(*rl.tabv), NULL);
+	if (!rl.tabv)
+		return ENOMEM;
+
+	if (rl.enabled)
+		restund_debug("ratelimit: binding=%u allocate=%u other=%u"
+			      " prefix=/%u,/%u\n",
+			      rl.ratev[RL_BINDING],
+			      rl.ratev[RL_ALLOCATE],
+			      rl.ratev[RL_OTHER],
+			      rl.prefix4, rl.prefix6);
+
+	return 0;
+}
+
+
+void restund_ratelimit_close(void)
+{
+	rl.tabv = mem_deref(rl.tabv);
+	rl.tabc = 0;
+	rl.enabled = false;
+}
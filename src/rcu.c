@@ -0,0 +1,81 @@
+/**
+ * @file rcu.c Epoch-based Read-Copy-Update
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <unistd.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * Shared read-mostly data is published with an epoch scheme: readers
+ * never lock. A reader announces the global epoch in the slot of its
+ * event loop and clears the slot when done. A writer swaps in the new
+ * data, calls restund_rcu_synchronize() and then frees the old data; it
+ * advances the epoch and waits until no slot holds an older epoch.
+ * Read sections must be short and must not nest.
+ */
+
+
+struct rcu_slot {
+	uint64_t epoch;             /* 0 if not reading */
+	uint8_t pad[64 - sizeof(uint64_t)];
+};
+
+
+enum {
+	RCU_POLL_US = 1000,
+};
+
+
+static struct {
+	struct rcu_slot slotv[WORKER_MAX + 1];
+	uint64_t epoch;
+} rcu = {
+	.epoch = 1,
+};
+
+
+void restund_rcu_read_lock(void)
+{
+	struct rcu_slot *slot = &rcu.slotv[restund_worker_index()];
+
+	__atomic_store_n(&slot->epoch,
+			 __atomic_load_n(&rcu.epoch, __ATOMIC_SEQ_CST),
+			 __ATOMIC_SEQ_CST);
+}
+
+
+void restund_rcu_read_unlock(void)
+{
+	struct rcu_slot *slot = &rcu.slotv[restund_worker_index()];
+
+	__atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/* wait until all readers that may still see old data are done */
+void restund_rcu_synchronize(void)
+{
+	uint64_t epoch;
+	uint32_t i;
+
+	epoch = __atomic_add_fetch(&rcu.epoch, 1, __ATOMIC_SEQ_CST);
+
+	for (i=0; i<ARRAY_SIZE(rcu.slotv); i++) {
+
+		const struct rcu_slot *slot = &rcu.slotv[i];
+
+		for (;;) {
+			uint64_t e = __atomic_load_n(&slot->epoch,
+						     __ATOMIC_ACQUIRE);
+			if (!e || e >= epoch)
+				break;
+
+			(void)usleep(RCU_POLL_US);
+		}
+	}
+}
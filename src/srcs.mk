@@ -4,10 +4,16 @@
 # Copyright (C) 2010 Creytiv.com
 #
 
+SRCS	+= acctab.c
+SRCS	+= batch.c
 SRCS	+= cmd.c
 SRCS	+= db.c
 SRCS	+= log.c
 SRCS	+= main.c
+SRCS	+= ratelimit.c
+SRCS	+= rcu.c
 SRCS	+= stun.c
 SRCS	+= udp.c
+SRCS	+= worker.c
 SRCS	+= tcp.c
+SRCS	+= tls.c
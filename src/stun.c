@@ -4,6 +4,7 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <string.h>
 #include <re.h>
 #include <restund.h>
 #include "stund.h"
@@ -12,25 +13,83 @@
 const char *restund_software = "restund v" VERSION " (" ARCH "/" OS ")";
 
 
+/* packet counters, one cache line per event loop */
+struct pktstat {
+	uint64_t pktc[RESTUND_PKT_MAX];
+	uint64_t decerrc;
+} __attribute__((aligned(64)));
+
+
 static struct {
 	struct list stunl;
+	struct pktstat statv[WORKER_MAX + 1];
 } stn;
 
 
+static inline enum restund_pkt pkt_class(const struct mbuf *mb)
+{
+	if (!mbuf_get_left(mb))
+		return RESTUND_PKT_OTHER;
+
+	switch (mbuf_buf(mb)[0] & 0xc0) {
+
+	case 0x00:
+		return RESTUND_PKT_STUN;
+
+	case 0x40:
+		return RESTUND_PKT_CHAN;
+
+	default:
+		return RESTUND_PKT_OTHER;
+	}
+}
+
+
 void restund_process_msg(int proto, void *sock,
 			 const struct sa *src, const struct sa *dst,
 			 struct mbuf *mb)
 {
-	struct le *le = stn.stunl.head;
+	struct le *le = stn.stunl.head, *lek;
 	struct restund_msgctx ctx;
+	struct pktstat *stat;
+	enum restund_pkt cls;
 	struct stun_msg *msg;
 	int err;
 
 	if (!sock || !src || !dst || !mb)
 		return;
 
+	cls  = pkt_class(mb);
+	stat = &stn.statv[restund_worker_index()];
+
+	++stat->pktc[cls];
+
+	switch (cls) {
+
+	case RESTUND_PKT_STUN:
+		if (!restund_ratelimit_check(src, mb))
+			return;
+		break;
+
+	case RESTUND_PKT_CHAN:
+		while (le) {
+			struct restund_stun *st = le->data;
+
+			le = le->next;
+
+			if (st->chanh && st->chanh(proto, src, dst, mb))
+				break;
+		}
+		return;
+
+	default:
+		return;
+	}
+
 	err = stun_msg_decode(&msg, mb, &ctx.ua);
 	if (err) {
+		++stat->decerrc;
+
 		while (le) {
 			struct restund_stun *st = le->data;
 
@@ -54,6 +113,15 @@ void restund_process_msg(int proto, void *sock,
 	switch (stun_msg_class(msg)) {
 
 	case STUN_CLASS_REQUEST:
+		/* a verified key skips the authentication handlers */
+		for (lek = le; lek; lek = lek->next) {
+			struct restund_stun *st = lek->data;
+
+			if (st->keyh &&
+			    st->keyh(&ctx, proto, sock, src, dst, msg))
+				break;
+		}
+
 		while (le) {
 			struct restund_stun *st = le->data;
 
@@ -104,3 +172,46 @@ void restund_stun_unregister_handler(struct restund_stun *stun)
 
 	list_unlink(&stun->le);
 }
+
+
+static void pktstat_handler(struct mbuf *mb)
+{
+	struct pktstat sum;
+	uint32_t i, j;
+
+	memset(&sum, 0, sizeof(sum));
+
+	for (i=0; i<restund_worker_count(); i++) {
+
+		for (j=0; j<RESTUND_PKT_MAX; j++)
+			sum.pktc[j] += stn.statv[i].pktc[j];
+
+		sum.decerrc += stn.statv[i].decerrc;
+	}
+
+	(void)mbuf_printf(mb, "stun_pkts %llu\n", sum.pktc[RESTUND_PKT_STUN]);
+	(void)mbuf_printf(mb, "stun_decode_err %llu\n", sum.decerrc);
+	(void)mbuf_printf(mb, "chandata_pkts %llu\n",
+			  sum.pktc[RESTUND_PKT_CHAN]);
+	(void)mbuf_printf(mb, "rejected_pkts %llu\n",
+			  sum.pktc[RESTUND_PKT_OTHER]);
+	restund_ratelimit_stat(mb);
+}
+
+
+static struct restund_cmdsub cmd_pktstat = {
+	.cmdh = pktstat_handler,
+	.cmd  = "pktstats",
+};
+
+
+void restund_stun_init(void)
+{
+	restund_cmd_subscribe(&cmd_pktstat);
+}
+
+
+void restund_stun_close(void)
+{
+	restund_cmd_unsubscribe(&cmd_pktstat);
+}
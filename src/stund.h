@@ -4,19 +4,62 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+enum {
+	MAX_FDS = 4096,
+	WORKER_MAX = 64,
+};
+
+/* worker */
+int  restund_worker_init(void);
+int  restund_worker_start(void);
+void restund_worker_close(void);
+
+/* udp batch */
+int  restund_batch_init(void);
+void restund_batch_close(void);
+
 /* udp */
 int  restund_udp_init(void);
 void restund_udp_close(void);
+int  restund_udp_thread_init(void);
+void restund_udp_thread_close(void);
 
 /* tcp */
 int  restund_tcp_init(void);
 void restund_tcp_close(void);
 
+/* tls */
+int  restund_tls_init(void);
+void restund_tls_close(void);
+int  restund_tls_setup(struct tls *tls);
+void restund_tls_status(struct mbuf *mb, const struct sa *laddr,
+			const struct tls *tls);
+
+/* rate limiter */
+int  restund_ratelimit_init(void);
+void restund_ratelimit_close(void);
+bool restund_ratelimit_check(const struct sa *src, const struct mbuf *mb);
+void restund_ratelimit_stat(struct mbuf *mb);
+
 /* stun */
+void restund_stun_init(void);
+void restund_stun_close(void);
 void restund_process_msg(int proto, void *sock,
 			 const struct sa *src, const struct sa *dst,
 			 struct mbuf *mb);
 
+/* account table */
+struct restund_acctab;
+
+int  restund_acctab_alloc(struct restund_acctab **tp, uint32_t hint);
+int  restund_acctab_add(struct restund_acctab *t, const char *username,
+			const uint8_t *ha1);
+int  restund_acctab_build(struct restund_acctab *t);
+const uint8_t *restund_acctab_find(const struct restund_acctab *t,
+				   const char *username);
+void restund_acctab_stat(const struct restund_acctab *t, uint32_t *n,
+			 uint32_t *dupc, size_t *bytes);
+
 /* database */
 int  restund_db_init(void);
 void restund_db_close(void);
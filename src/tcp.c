@@ -4,7 +4,13 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <string.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <re.h>
 #include <restund.h>
 #include "stund.h"
@@ -13,6 +19,8 @@
 enum {
 	TCP_MAX_LENGTH = 2048,
 	TCP_MAX_TXQSZ  = 16384,
+	TCP_BUF_SIZE   = STUN_HEADER_SIZE + TCP_MAX_LENGTH,
+	TCP_CORK_MAX   = 64,
 };
 
 
@@ -29,7 +37,10 @@ struct conn {
 	struct sa paddr;
 	struct tcp_conn *tc;
 	struct tls_conn *tlsc;
-	struct mbuf *mb;
+	struct mbuf *rb;
+	uint64_t framec;
+	uint64_t copyc;
+	size_t skip;
 	time_t created;
 };
 
@@ -38,15 +49,86 @@ static struct list lstnrl;
 static struct list tcl;
 
 
+/* sockets corked during the current event-loop iteration */
+static struct {
+	struct tmr tmr;
+	int fdv[TCP_CORK_MAX];
+	uint32_t fdc;
+} cork;
+
+
+static void cork_set(int fd, bool on)
+{
+#ifdef TCP_CORK
+	const int v = on;
+
+	(void)setsockopt(fd, IPPROTO_TCP, TCP_CORK, &v, sizeof(v));
+#else
+	(void)fd;
+	(void)on;
+#endif
+}
+
+
+static void cork_flush(void *arg)
+{
+	uint32_t i;
+	(void)arg;
+
+	for (i=0; i<cork.fdc; i++)
+		cork_set(cork.fdv[i], false);
+
+	cork.fdc = 0;
+}
+
+
+/* cork fd until the end of this event-loop iteration */
+static void cork_add(int fd)
+{
+	uint32_t i;
+
+	for (i=0; i<cork.fdc; i++) {
+		if (cork.fdv[i] == fd)
+			return;
+	}
+
+	if (cork.fdc >= TCP_CORK_MAX)
+		cork_flush(NULL);
+
+	cork_set(fd, true);
+	cork.fdv[cork.fdc++] = fd;
+
+	if (!tmr_isrunning(&cork.tmr))
+		tmr_start(&cork.tmr, 0, cork_flush, NULL);
+}
+
+
+static void cork_remove(int fd)
+{
+	uint32_t i;
+
+	for (i=0; i<cork.fdc; i++) {
+
+		if (cork.fdv[i] != fd)
+			continue;
+
+		cork.fdv[i] = cork.fdv[--cork.fdc];
+		return;
+	}
+}
+
+
 static void conn_destructor(void *arg)
 {
 	struct conn *conn = arg;
 
 	list_unlink(&conn->le);
+	if (conn->tc)
+		cork_remove(tcp_conn_fd(conn->tc));
 	tcp_set_handlers(conn->tc, NULL, NULL, NULL, NULL);
 	mem_deref(conn->tlsc);
 	mem_deref(conn->tc);
-	mem_deref(conn->mb);
+	mem_deref(conn->rb);
 }
 
 
@@ -56,89 +138,170 @@ static inline uint32_t refc_idle(struct conn *conn)
 }
 
 
-static void tcp_recv(struct mbuf *mb, void *arg)
+/* size of the frame starting with the 4 byte header at p, no padding */
+static int frame_size(size_t *szp, const uint8_t *p)
 {
-	struct conn *conn = arg;
-	int err = 0;
+	uint16_t typ, len;
 
-	if (conn->mb) {
-		size_t pos;
+	typ = p[0] << 8 | p[1];
+	len = p[2] << 8 | p[3];
 
-		pos = conn->mb->pos;
+	if (len > TCP_MAX_LENGTH) {
+		restund_debug("tcp: bad length: %u\n", len);
+		return EBADMSG;
+	}
 
-		conn->mb->pos = conn->mb->end;
+	if (typ < 0x4000)
+		*szp = len + STUN_HEADER_SIZE;
+	else if (typ < 0x8000)
+		*szp = len + 4;
+	else {
+		restund_debug("tcp: bad type: 0x%04x\n", typ);
+		return EBADMSG;
+	}
 
-		err = mbuf_write_mem(conn->mb, mbuf_buf(mb),mbuf_get_left(mb));
-		if (err) {
-			restund_warning("tcp: buffer write error: %m\n", err);
-			goto out;
-		}
+	return 0;
+}
 
-		conn->mb->pos = pos;
-	}
-	else {
-		conn->mb = mem_ref(mb);
+
+static void frame_process(struct conn *conn, struct mbuf *mb, size_t pos,
+			  size_t sz)
+{
+	const size_t end = mb->end;
+
+	mb->pos = pos;
+	mb->end = pos + sz;
+
+	restund_process_msg(IPPROTO_TCP, conn->tc, &conn->paddr,
+			    &conn->laddr, mb);
+
+	mb->pos = pos + sz;
+	mb->end = end;
+
+	/* 4 byte alignment, padding may arrive with the next segment */
+	conn->skip = (4 - (sz & 0x03)) & 0x03;
+}
+
+
+static void frame_skip(struct conn *conn, struct mbuf *mb)
+{
+	const size_t n = MIN(conn->skip, mbuf_get_left(mb));
+
+	mb->pos += n;
+	conn->skip -= n;
+}
+
+
+static int conn_write(struct conn *conn, struct mbuf *mb, size_t n)
+{
+	struct mbuf *rb = conn->rb;
+
+	if (rb->end + n > rb->size)
+		return EOVERFLOW;
+
+	rb->pos = rb->end;
+	(void)mbuf_write_mem(rb, mbuf_buf(mb), n);
+	mb->pos += n;
+
+	return 0;
+}
+
+
+/* complete the frame held in the connection buffer, copying only its bytes */
+static int conn_fill(struct conn *conn, struct mbuf *mb)
+{
+	struct mbuf *rb = conn->rb;
+	size_t sz;
+	int err;
+
+	if (rb->end < 4) {
+		err = conn_write(conn, mb, MIN(4 - rb->end,
+					       mbuf_get_left(mb)));
+		if (err || rb->end < 4)
+			return err;
 	}
 
-	for (;;) {
+	err = frame_size(&sz, rb->buf);
+	if (err)
+		return err;
 
-		size_t len, pos, end;
-		uint16_t typ;
+	err = conn_write(conn, mb, MIN(sz - rb->end, mbuf_get_left(mb)));
+	if (err || rb->end < sz)
+		return err;
 
-		if (mbuf_get_left(conn->mb) < 4)
-			break;
+	++conn->copyc;
+	frame_process(conn, rb, 0, sz);
 
-		typ = ntohs(mbuf_read_u16(conn->mb));
-		len = ntohs(mbuf_read_u16(conn->mb));
+	/* recycle the buffer, unless a handler still holds it */
+	if (mem_nrefs(rb) > 1)
+		conn->rb = mem_deref(rb);
+	else
+		rb->pos = rb->end = 0;
 
-		if (len > TCP_MAX_LENGTH) {
-			restund_debug("tcp: bad length: %zu\n", len);
-			err = EBADMSG;
-			goto out;
-		}
+	return 0;
+}
 
-		if (typ < 0x4000)
-			len += STUN_HEADER_SIZE;
-		else if (typ < 0x8000)
-			len += 4;
-		else {
-			restund_debug("tcp: bad type: 0x%04x\n", typ);
-			err = EBADMSG;
-			goto out;
-		}
 
-		conn->mb->pos -= 4;
+static void tcp_recv(struct mbuf *mb, void *arg)
+{
+	struct conn *conn = arg;
+	int err = 0;
 
-		if (mbuf_get_left(conn->mb) < len)
-			break;
+	frame_skip(conn, mb);
 
-		pos = conn->mb->pos;
-		end = conn->mb->end;
+	if (conn->rb && conn->rb->end) {
+		err = conn_fill(conn, mb);
+		if (err)
+			goto out;
 
-		conn->mb->end = pos + len;
+		frame_skip(conn, mb);
+	}
 
-		restund_process_msg(IPPROTO_TCP, conn->tc, &conn->paddr,
-				    &conn->laddr, conn->mb);
+	/* complete frames are processed in place */
+	for (;;) {
 
-		/* 4 byte alignment */
-		while (len & 0x03)
-			++len;
+		const size_t pos = mb->pos;
+		size_t sz;
 
-		conn->mb->pos = pos + len;
-		conn->mb->end = end;
+		if (mbuf_get_left(mb) < 4)
+			break;
 
-		if (conn->mb->pos >= conn->mb->end) {
-			conn->mb = mem_deref(conn->mb);
+		err = frame_size(&sz, mbuf_buf(mb));
+		if (err)
+			goto out;
+
+		if (mbuf_get_left(mb) < sz)
 			break;
+
+		++conn->framec;
+		frame_process(conn, mb, pos, sz);
+		frame_skip(conn, mb);
+	}
+
+	/* keep the partial frame, at most one frame is ever buffered */
+	if (mbuf_get_left(mb)) {
+
+		if (!conn->rb) {
+			conn->rb = mbuf_alloc(TCP_BUF_SIZE);
+			if (!conn->rb) {
+				err = ENOMEM;
+				goto out;
+			}
 		}
+
+		err = conn_write(conn, mb, mbuf_get_left(mb));
 	}
 
  out:
 	if (err) {
+		restund_debug("tcp: receive error: %m\n", err);
+
 		if (mem_nrefs(conn->tc) <= refc_idle(conn))
 			mem_deref(conn);
-		else
-			conn->mb = mem_deref(conn->mb);
+		else {
+			conn->rb = mem_deref(conn->rb);
+			conn->skip = 0;
+		}
 	}
 }
 
@@ -212,13 +375,23 @@ static void status_handler(struct mbuf *mb)
 	const time_t now = time(NULL);
 	struct le *le;
 
+	for (le=lstnrl.head; le; le=le->next) {
+
+		const struct tcp_lstnr *tl = le->data;
+
+		if (tl->tls)
+			restund_tls_status(mb, &tl->bnd_addr, tl->tls);
+	}
+
 	for (le=tcl.head; le; le=le->next) {
 
 		const struct conn *conn = le->data;
 
-		(void)mbuf_printf(mb, "%J - %J %llis\n",
+		(void)mbuf_printf(mb, "%J - %J %llis (frames %llu/%llu,"
+				  " buffered %zu)\n",
 				  &conn->laddr, &conn->paddr,
-				  now - conn->created);
+				  now - conn->created, conn->framec,
+				  conn->copyc, conn->rb ? conn->rb->end : 0);
 	}
 }
 
@@ -267,6 +440,12 @@ static int listen_handler(const struct pl *val, void *arg)
 			restund_warning("tls error: %m\n", err);
 			goto out;
 		}
+
+		err = restund_tls_setup(tl->tls);
+		if (err) {
+			restund_warning("tls session setup: %m\n", err);
+			goto out;
+		}
 #else
 		restund_warning("tls not supported\n");
 		err = EPROTONOSUPPORT;
@@ -318,6 +497,10 @@ int restund_tcp_init(void)
 
 	restund_cmd_subscribe(&cmd_tcp);
 
+	err = restund_tls_init();
+	if (err)
+		goto out;
+
 	/* tcp config */
 	tls = false;
 
@@ -342,8 +525,93 @@ int restund_tcp_init(void)
 void restund_tcp_close(void)
 {
 	restund_cmd_unsubscribe(&cmd_tcp);
+	cork_flush(NULL);
+	tmr_cancel(&cork.tmr);
 	list_flush(&lstnrl);
 	list_flush(&tcl);
+	restund_tls_close();
+}
+
+
+/* true if data can be written to the socket of tc directly (no TLS) */
+bool restund_tcp_gather(const struct tcp_conn *tc)
+{
+	struct le *le;
+
+	for (le=tcl.head; le; le=le->next) {
+
+		const struct conn *conn = le->data;
+
+		if (conn->tc == tc)
+			return conn->tlsc == NULL;
+	}
+
+	return false;
+}
+
+
+/*
+ * Gather-write iov to a plain TCP connection. The socket stays corked
+ * until the end of the event-loop iteration, so consecutive frames are
+ * coalesced. Anything the socket does not take is queued on the tcp_conn.
+ */
+int restund_tcp_sendv(struct tcp_conn *tc, const struct iovec *iov, int iovc)
+{
+	struct msghdr msg;
+	struct mbuf *mb;
+	size_t total = 0, skip;
+	ssize_t n = 0;
+	int i, fd, err;
+
+	if (!tc || !iov || iovc <= 0)
+		return EINVAL;
+
+	for (i=0; i<iovc; i++)
+		total += iov[i].iov_len;
+
+	fd = tcp_conn_fd(tc);
+
+	/* queued data must go first */
+	if (fd >= 0 && !tcp_conn_txqsz(tc)) {
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = (struct iovec *)iov;
+		msg.msg_iovlen = iovc;
+
+		cork_add(fd);
+
+		n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return errno;
+			n = 0;
+		}
+
+		if ((size_t)n == total)
+			return 0;
+	}
+
+	mb = mbuf_alloc(total - n);
+	if (!mb)
+		return ENOMEM;
+
+	for (i=0, skip=n; i<iovc; i++) {
+
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		(void)mbuf_write_mem(mb, (uint8_t *)iov[i].iov_base + skip,
+				     iov[i].iov_len - skip);
+		skip = 0;
+	}
+
+	mb->pos = 0;
+	err = tcp_send(tc, mb);
+	mem_deref(mb);
+
+	return err;
 }
 
 
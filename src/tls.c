@@ -0,0 +1,281 @@
+/**
+ * @file tls.c TLS Session Resumption
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#ifdef USE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#endif
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * TLS listeners keep a server-side session cache and issue stateless
+ * session tickets. The ticket keys are shared by all listeners and
+ * rotated every tls_ticket_lifetime seconds; tickets sealed with the
+ * previous key are still accepted and renewed.
+ */
+
+
+enum {
+	TLS_CACHE_DEFAULT  = 4096,
+	TLS_TICKET_DEFAULT = 3600,  /* seconds */
+};
+
+
+#ifdef USE_OPENSSL
+struct tkey {
+	uint8_t name[16];
+	uint8_t aes[32];
+	uint8_t hmac[32];
+	bool valid;
+};
+
+
+static struct {
+	struct tkey cur;
+	struct tkey prev;
+	struct tmr tmr;
+	uint32_t cache_size;
+	uint32_t lifetime;
+	uint64_t ticket_newc;
+	uint64_t ticket_okc;
+	uint64_t ticket_renewc;
+	uint64_t ticket_failc;
+} tlsc;
+
+
+static int tkey_generate(struct tkey *k)
+{
+	if (RAND_bytes(k->name, sizeof(k->name)) <= 0 ||
+	    RAND_bytes(k->aes, sizeof(k->aes)) <= 0 ||
+	    RAND_bytes(k->hmac, sizeof(k->hmac)) <= 0)
+		return EIO;
+
+	k->valid = true;
+
+	return 0;
+}
+
+
+static void rotate_handler(void *arg)
+{
+	struct tkey k;
+	(void)arg;
+
+	tmr_start(&tlsc.tmr, tlsc.lifetime * 1000, rotate_handler, NULL);
+
+	if (tkey_generate(&k)) {
+		restund_warning("tls: ticket key rotation failed\n");
+		return;
+	}
+
+	tlsc.prev = tlsc.cur;
+	tlsc.cur  = k;
+
+	restund_debug("tls: ticket keys rotated\n");
+}
+
+
+static const struct tkey *tkey_find(const unsigned char *name)
+{
+	if (tlsc.cur.valid && !memcmp(name, tlsc.cur.name, 16))
+		return &tlsc.cur;
+
+	if (tlsc.prev.valid && !memcmp(name, tlsc.prev.name, 16))
+		return &tlsc.prev;
+
+	return NULL;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX hmac_ctx_t;
+
+static int hmac_init(EVP_MAC_CTX *hctx, const struct tkey *k)
+{
+	OSSL_PARAM params[2];
+
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+						     "SHA256", 0);
+	params[1] = OSSL_PARAM_construct_end();
+
+	return EVP_MAC_init(hctx, k->hmac, sizeof(k->hmac), params);
+}
+#else
+typedef HMAC_CTX hmac_ctx_t;
+
+static int hmac_init(HMAC_CTX *hctx, const struct tkey *k)
+{
+	return HMAC_Init_ex(hctx, k->hmac, sizeof(k->hmac), EVP_sha256(),
+			    NULL);
+}
+#endif
+
+
+/* 1: ticket ok, 2: ticket ok but renew, 0: full handshake, -1: error */
+static int ticket_handler(SSL *ssl, unsigned char *name, unsigned char *iv,
+			  EVP_CIPHER_CTX *ectx, hmac_ctx_t *hctx, int enc)
+{
+	const struct tkey *k;
+	(void)ssl;
+
+	if (enc) {
+		k = &tlsc.cur;
+
+		if (!k->valid ||
+		    RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc()))<=0)
+			return -1;
+
+		memcpy(name, k->name, sizeof(k->name));
+
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+					k->aes, iv) ||
+		    !hmac_init(hctx, k))
+			return -1;
+
+		++tlsc.ticket_newc;
+
+		return 1;
+	}
+
+	k = tkey_find(name);
+	if (!k) {
+		++tlsc.ticket_failc;
+		return 0;
+	}
+
+	if (!hmac_init(hctx, k) ||
+	    !EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes, iv))
+		return -1;
+
+	if (k == &tlsc.cur) {
+		++tlsc.ticket_okc;
+		return 1;
+	}
+
+	++tlsc.ticket_renewc;
+
+	return 2;
+}
+#endif
+
+
+int restund_tls_init(void)
+{
+#ifdef USE_OPENSSL
+	int err;
+
+	tlsc.cache_size = TLS_CACHE_DEFAULT;
+	tlsc.lifetime   = TLS_TICKET_DEFAULT;
+
+	(void)conf_get_u32(restund_conf(), "tls_session_cache_size",
+			   &tlsc.cache_size);
+	(void)conf_get_u32(restund_conf(), "tls_ticket_lifetime",
+			   &tlsc.lifetime);
+
+	tmr_init(&tlsc.tmr);
+
+	if (!tlsc.lifetime)
+		return 0;
+
+	err = tkey_generate(&tlsc.cur);
+	if (err) {
+		restund_error("tls: ticket key: %m\n", err);
+		return err;
+	}
+
+	tmr_start(&tlsc.tmr, tlsc.lifetime * 1000, rotate_handler, NULL);
+#endif
+
+	return 0;
+}
+
+
+void restund_tls_close(void)
+{
+#ifdef USE_OPENSSL
+	tmr_cancel(&tlsc.tmr);
+	memset(&tlsc.cur, 0, sizeof(tlsc.cur));
+	memset(&tlsc.prev, 0, sizeof(tlsc.prev));
+#endif
+}
+
+
+/* enable session cache and tickets on a tls_listen context */
+int restund_tls_setup(struct tls *tls)
+{
+#ifdef USE_OPENSSL
+	static const unsigned char sid_ctx[] = "restund";
+	SSL_CTX *ctx = tls_openssl_context(tls);
+
+	if (!ctx)
+		return EINVAL;
+
+	if (!SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx)-1))
+		return EINVAL;
+
+	if (tlsc.cache_size) {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(ctx, tlsc.cache_size);
+	}
+	else {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	}
+
+	if (tlsc.lifetime) {
+		(void)SSL_CTX_set_timeout(ctx, 2 * tlsc.lifetime);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_handler);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_handler);
+#endif
+	}
+	else {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	}
+#else
+	(void)tls;
+#endif
+
+	return 0;
+}
+
+
+void restund_tls_status(struct mbuf *mb, const struct sa *laddr,
+			const struct tls *tls)
+{
+#ifdef USE_OPENSSL
+	SSL_CTX *ctx = tls_openssl_context(tls);
+	long hsc, hitc;
+
+	if (!ctx)
+		return;
+
+	hsc  = SSL_CTX_sess_accept_good(ctx);
+	hitc = SSL_CTX_sess_hits(ctx);
+
+	(void)mbuf_printf(mb, "tls %J: handshakes %ld resumed %ld (%ld%%)"
+			  " cache %ld/%u tickets %llu/%llu/%llu/%llu\n",
+			  laddr, hsc, hitc, hsc ? 100 * hitc / hsc : 0,
+			  SSL_CTX_sess_number(ctx), tlsc.cache_size,
+			  tlsc.ticket_newc, tlsc.ticket_okc,
+			  tlsc.ticket_renewc, tlsc.ticket_failc);
+#else
+	(void)mb;
+	(void)laddr;
+	(void)tls;
+#endif
+}
@@ -4,6 +4,10 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <re.h>
 #include <restund.h>
 #include "stund.h"
@@ -13,10 +17,16 @@ struct udp_lstnr {
 	struct le le;
 	struct sa bnd_addr;
 	struct udp_sock *us;
+	struct restund_udp_batch *ub;
 };
 
 
-static struct list lstnrl;
+/* one listener list per event loop */
+static struct {
+	struct list *lstnrv;
+	uint32_t lstnrc;
+	uint32_t sockbuf_size;
+} udp;
 
 
 static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
@@ -32,13 +42,61 @@ static void destructor(void *arg)
 	struct udp_lstnr *ul = arg;
 
 	list_unlink(&ul->le);
+	mem_deref(ul->ub);
 	mem_deref(ul->us);
 }
 
 
+#ifdef SO_REUSEPORT
+/*
+ * libre binds the socket inside udp_listen(), so SO_REUSEPORT can not be
+ * set in time. The socket is bound here and handed to libre, which owns
+ * the descriptor from then on.
+ */
+static int reuseport_listen(struct udp_sock **usp, const struct sa *laddr,
+			    udp_recv_h *rh, void *arg)
+{
+	const int on = 1;
+	int fd, err;
+
+	fd = socket(sa_af(laddr), SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+		return errno;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+		err = errno;
+		goto out;
+	}
+
+#ifdef IPV6_V6ONLY
+	if (sa_af(laddr) == AF_INET6)
+		(void)setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+				 &on, sizeof(on));
+#endif
+
+	if (bind(fd, &laddr->u.sa, laddr->len) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	err = net_sockopt_blocking_set(fd, false);
+	if (err)
+		goto out;
+
+	err = udp_alloc_fd(usp, fd, rh, arg);
+
+ out:
+	if (err)
+		(void)close(fd);
+
+	return err;
+}
+#endif
+
+
 static int listen_handler(const struct pl *addrport, void *arg)
 {
-	uint32_t sockbuf_size = *(uint32_t *)arg;
+	struct list *lstnrl = arg;
 	struct udp_lstnr *ul = NULL;
 	int err = ENOMEM;
 
@@ -48,7 +106,7 @@ static int listen_handler(const struct pl *addrport, void *arg)
 		goto out;
 	}
 
-	list_append(&lstnrl, &ul->le, ul);
+	list_append(lstnrl, &ul->le, ul);
 
 	err = sa_decode(&ul->bnd_addr, addrport->p, addrport->l);
 	if (err || sa_is_any(&ul->bnd_addr) || !sa_port(&ul->bnd_addr)) {
@@ -57,16 +115,32 @@ static int listen_handler(const struct pl *addrport, void *arg)
 		goto out;
 	}
 
-	err = udp_listen(&ul->us, &ul->bnd_addr, udp_recv, ul);
+#ifdef SO_REUSEPORT
+	if (restund_worker_count() > 1)
+		err = reuseport_listen(&ul->us, &ul->bnd_addr, udp_recv, ul);
+	else
+#endif
+		err = udp_listen(&ul->us, &ul->bnd_addr, udp_recv, ul);
 	if (err) {
 		restund_warning("udp listen %J: %m\n", &ul->bnd_addr, err);
 		goto out;
 	}
 
-	if (sockbuf_size > 0)
-		(void)udp_sockbuf_set(ul->us, sockbuf_size);
+	if (udp.sockbuf_size > 0)
+		(void)udp_sockbuf_set(ul->us, udp.sockbuf_size);
+
+	if (restund_udp_batch_size()) {
+		err = restund_udp_batch_alloc(&ul->ub, ul->us, &ul->bnd_addr,
+					      udp_recv, ul, NULL);
+		if (err) {
+			restund_warning("udp batch %J: %m\n",
+					&ul->bnd_addr, err);
+			goto out;
+		}
+	}
 
-	restund_debug("udp listen: %J\n", &ul->bnd_addr);
+	restund_debug("udp listen: %J (worker %u)\n", &ul->bnd_addr,
+		      restund_worker_index());
 
  out:
 	if (err)
@@ -78,15 +152,18 @@ static int listen_handler(const struct pl *addrport, void *arg)
 
 int restund_udp_init(void)
 {
-	uint32_t sockbuf_size = 0;
 	int err;
 
-	list_init(&lstnrl);
+	udp.sockbuf_size = 0;
+	(void)conf_get_u32(restund_conf(), "udp_sockbuf_size",
+			   &udp.sockbuf_size);
 
-	(void)conf_get_u32(restund_conf(), "udp_sockbuf_size", &sockbuf_size);
+	udp.lstnrc = restund_worker_count();
+	udp.lstnrv = mem_zalloc(udp.lstnrc * sizeof(*udp.lstnrv), NULL);
+	if (!udp.lstnrv)
+		return ENOMEM;
 
-	err = conf_apply(restund_conf(), "udp_listen", listen_handler,
-			 &sockbuf_size);
+	err = restund_udp_thread_init();
 	if (err)
 		goto out;
 
@@ -98,16 +175,66 @@ int restund_udp_init(void)
 }
 
 
+/* called on every event loop to create its listen sockets */
+int restund_udp_thread_init(void)
+{
+	struct list *lstnrl;
+
+	if (!udp.lstnrv)
+		return EINVAL;
+
+	lstnrl = &udp.lstnrv[restund_worker_index()];
+
+	list_init(lstnrl);
+
+	return conf_apply(restund_conf(), "udp_listen", listen_handler,
+			  lstnrl);
+}
+
+
+void restund_udp_thread_close(void)
+{
+	if (!udp.lstnrv)
+		return;
+
+	list_flush(&udp.lstnrv[restund_worker_index()]);
+}
+
+
+static void flush_handler(void *arg)
+{
+	(void)arg;
+
+	restund_udp_thread_close();
+}
+
+
 void restund_udp_close(void)
 {
-	list_flush(&lstnrl);
+	uint32_t i;
+
+	if (!udp.lstnrv)
+		return;
+
+	for (i=1; i<udp.lstnrc; i++)
+		(void)restund_worker_call(i, flush_handler, NULL);
+
+	list_flush(&udp.lstnrv[0]);
+
+	udp.lstnrv = mem_deref(udp.lstnrv);
+	udp.lstnrc = 0;
 }
 
 
 struct udp_sock *restund_udp_socket(struct sa *sa, const struct sa *orig,
 				    bool ch_ip, bool ch_port)
 {
-	struct le *le = list_head(&lstnrl);
+	struct le *le;
+
+	if (!udp.lstnrv)
+		return NULL;
+
+	le = list_head(&udp.lstnrv[restund_worker_index()]);
 
 	while (le) {
 		struct udp_lstnr *ul = le->data;
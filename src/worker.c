@@ -0,0 +1,321 @@
+/**
+ * @file worker.c Worker Threads
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <re.h>
+#include <restund.h>
+#include "stund.h"
+
+
+/*
+ * In worker mode each worker thread runs its own libre event loop and
+ * owns a SO_REUSEPORT clone of every UDP listen socket. The kernel
+ * spreads the clients across the clones by 4-tuple, so all packets of
+ * one client end up on the same worker. Event loop 0 is the main thread,
+ * which keeps serving TCP/TLS, the database and the status interface.
+ */
+
+
+enum {
+	WORKER_CALL = 0,
+	WORKER_QUIT,
+};
+
+
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct mqueue *mq;
+	uint32_t idx;
+	int err;
+	bool ready;
+	bool run;
+};
+
+struct call {
+	restund_worker_h *h;
+	void *arg;
+	bool done;
+};
+
+
+static struct {
+	struct worker *workerv;
+	uint32_t workerc;
+	pthread_key_t key;
+	bool key_set;
+} wrk;
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct worker *w = arg;
+	struct call *call = data;
+
+	switch (id) {
+
+	case WORKER_CALL:
+		call->h(call->arg);
+
+		pthread_mutex_lock(&w->mutex);
+		call->done = true;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->mutex);
+		break;
+
+	case WORKER_QUIT:
+		re_cancel();
+		break;
+	}
+}
+
+
+static void worker_ready(struct worker *w, int err)
+{
+	pthread_mutex_lock(&w->mutex);
+	w->err = err;
+	w->ready = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	sigset_t set;
+	int err;
+
+	/* signals are handled by the main thread */
+	(void)sigfillset(&set);
+	(void)pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	(void)pthread_setspecific(wrk.key, w);
+
+	err = re_thread_init();
+	if (err) {
+		restund_error("worker %u: re thread init: %m\n", w->idx, err);
+		worker_ready(w, err);
+		return NULL;
+	}
+
+	err = fd_setsize(MAX_FDS);
+	if (err)
+		goto out;
+
+	err = mqueue_alloc(&w->mq, mqueue_handler, w);
+	if (err)
+		goto out;
+
+	err = restund_udp_thread_init();
+	if (err)
+		goto out;
+
+	worker_ready(w, 0);
+
+	restund_debug("worker %u: running\n", w->idx);
+
+	err = re_main(NULL);
+
+ out:
+	restund_udp_thread_close();
+	w->mq = mem_deref(w->mq);
+
+	if (!w->ready) {
+		restund_error("worker %u: init failed: %m\n", w->idx, err);
+		worker_ready(w, err);
+	}
+
+	re_thread_close();
+
+	return NULL;
+}
+
+
+static void workerv_destructor(void *arg)
+{
+	struct worker *workerv = arg;
+	uint32_t i;
+
+	for (i=0; i<wrk.workerc; i++) {
+		pthread_mutex_destroy(&workerv[i].mutex);
+		pthread_cond_destroy(&workerv[i].cond);
+	}
+}
+
+
+uint32_t restund_worker_count(void)
+{
+	return wrk.workerc + 1;
+}
+
+
+uint32_t restund_worker_index(void)
+{
+	const struct worker *w;
+
+	if (!wrk.key_set)
+		return 0;
+
+	w = pthread_getspecific(wrk.key);
+
+	return w ? w->idx : 0;
+}
+
+
+/* run handler on the event loop of a worker and wait for it */
+int restund_worker_call(uint32_t idx, restund_worker_h *h, void *arg)
+{
+	struct call call;
+	struct worker *w;
+	int err;
+
+	if (!h || idx > wrk.workerc)
+		return EINVAL;
+
+	if (idx == restund_worker_index()) {
+		h(arg);
+		return 0;
+	}
+
+	if (idx == 0)
+		return EINVAL;
+
+	w = &wrk.workerv[idx - 1];
+
+	/* nothing runs on a stopped worker */
+	if (!w->run) {
+		h(arg);
+		return 0;
+	}
+
+	call.h    = h;
+	call.arg  = arg;
+	call.done = false;
+
+	err = mqueue_push(w->mq, WORKER_CALL, &call);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&w->mutex);
+	while (!call.done)
+		pthread_cond_wait(&w->cond, &w->mutex);
+	pthread_mutex_unlock(&w->mutex);
+
+	return 0;
+}
+
+
+int restund_worker_init(void)
+{
+	uint32_t i, n = 0;
+	int err;
+
+	(void)conf_get_u32(restund_conf(), "worker_threads", &n);
+
+	if (!n)
+		return 0;
+
+#ifndef SO_REUSEPORT
+	restund_warning("worker threads not supported on this platform\n");
+	return 0;
+#endif
+
+	if (n > WORKER_MAX) {
+		restund_warning("worker_threads: max %u\n", WORKER_MAX);
+		n = WORKER_MAX;
+	}
+
+	err = pthread_key_create(&wrk.key, NULL);
+	if (err) {
+		restund_error("worker key: %m\n", err);
+		return err;
+	}
+
+	wrk.key_set = true;
+
+	wrk.workerv = mem_zalloc(n * sizeof(*wrk.workerv), workerv_destructor);
+	if (!wrk.workerv)
+		return ENOMEM;
+
+	for (i=0; i<n; i++) {
+		pthread_mutex_init(&wrk.workerv[i].mutex, NULL);
+		pthread_cond_init(&wrk.workerv[i].cond, NULL);
+		wrk.workerv[i].idx = i + 1;
+	}
+
+	wrk.workerc = n;
+
+	restund_debug("worker threads: %u\n", wrk.workerc);
+
+	return 0;
+}
+
+
+int restund_worker_start(void)
+{
+	uint32_t i;
+	int err;
+
+	for (i=0; i<wrk.workerc; i++) {
+
+		struct worker *w = &wrk.workerv[i];
+
+		w->ready = false;
+
+		err = pthread_create(&w->thread, NULL, worker_thread, w);
+		if (err) {
+			restund_error("worker %u: thread error: %m\n",
+				      w->idx, err);
+			return err;
+		}
+
+		pthread_mutex_lock(&w->mutex);
+		while (!w->ready)
+			pthread_cond_wait(&w->cond, &w->mutex);
+		err = w->err;
+		pthread_mutex_unlock(&w->mutex);
+
+		if (err) {
+			pthread_join(w->thread, NULL);
+			return err;
+		}
+
+		w->run = true;
+	}
+
+	return 0;
+}
+
+
+void restund_worker_close(void)
+{
+	uint32_t i;
+
+	for (i=0; i<wrk.workerc; i++) {
+
+		struct worker *w = &wrk.workerv[i];
+
+		if (!w->run)
+			continue;
+
+		(void)mqueue_push(w->mq, WORKER_QUIT, NULL);
+		pthread_join(w->thread, NULL);
+		w->run = false;
+	}
+
+	wrk.workerv = mem_deref(wrk.workerv);
+	wrk.workerc = 0;
+
+	if (wrk.key_set) {
+		(void)pthread_key_delete(wrk.key);
+		wrk.key_set = false;
+	}
+}